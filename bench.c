@@ -0,0 +1,299 @@
+/*******************************************************************************
+ * bench.c
+ *
+ * Benchmark of the Media plugin sync engine against a simulated Palm VFS device.
+ * Creates synthetic media libraries and reports wall time, DLP round trips,
+ * bytes moved and modeled link time of an initial and an unchanged sync.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "libplugin.h"
+#include "jpstub.h"
+#include "media.h"
+#include "vfssim.h"
+
+static const char USAGE[] =
+"Usage: media-bench [options] [files ...]\n\
+Syncs synthetic libraries of the given numbers of files (default: 100 1000 10000 100000)\n\
+with a simulated Palm device and reports wall time, round trips and bytes moved.\n\
+  -a n     number of albums to spread the files over (default: 10)\n\
+  -s n     size of each file in bytes (default: 1024)\n\
+  -l us    modeled latency per DLP call in microseconds (default: 2000)\n\
+  -b n     modeled link bandwidth in bytes per second (default: 115200)\n\
+  -r       really sleep the modeled time\n\
+  -i       simulate broken dir iterators\n\
+  -c       add an empty album and simulate the crash on enumerating empty dirs\n\
+  -x n     drop the connection after n bytes were transferred in each sync\n\
+  -p n=v   set pref n of the plugin to value v, i.e. -p dryRun=1\n\
+  -d       print sync and debug log\n\
+  -k       keep the generated files\n\
+  -m       only time the name lookups, indexed vs. linear, in dirs of 1000 and 10000 files\n\
+  -t       only check the plan, which the diff of a snapshot with known changes derives\n";
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int makeDirs(const char *path) {
+    char tmp[FILENAME_MAX];
+    strcpy(tmp, path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0777);
+            *p = '/';
+        }
+    }
+    return mkdir(tmp, 0777) && errno != EEXIST;
+}
+
+/* Create a library with files spread over albums in /DCIM of SD card volume 2, optionally plus an empty one. */
+static int createLibrary(const char *root, const int files, const int albums, const int size, const int emptyAlbum) {
+    char path[FILENAME_MAX];
+    char *data = calloc(1, size);
+    if (!data)  return EXIT_FAILURE;
+    for (int a = 0; a < albums; a++) {
+        snprintf(path, sizeof(path), "%s/2/DCIM/Album%03d", root, a);
+        if (makeDirs(path))  return EXIT_FAILURE;
+    }
+    snprintf(path, sizeof(path), "%s/2/DCIM/Empty", root);
+    if (emptyAlbum && makeDirs(path))  return EXIT_FAILURE;
+    snprintf(path, sizeof(path), "%s/1", root);
+    makeDirs(path);
+    for (int f = 0; f < files; f++) {
+        FILE *fileP;
+        snprintf(path, sizeof(path), "%s/2/DCIM/Album%03d/photo_%06d.jpg", root, f % albums, f);
+        memcpy(data, &f, MIN(sizeof(f), (size_t)size));
+        if (!(fileP = fopen(path, "w")) || fwrite(data, 1, size, fileP) != (size_t)size)
+            return EXIT_FAILURE;
+        fclose(fileP);
+    }
+    free(data);
+    return EXIT_SUCCESS;
+}
+
+/* Write the prefs given as "name=value" as lines "name value" to the rc file of the plugin in dir home. */
+static int writePrefs(const char *home, char *prefs[], const int count) {
+    char path[FILENAME_MAX];
+    FILE *out;
+    snprintf(path, sizeof(path), "%s/%s.rc", home, PACKAGE);
+    if (!(out = fopen(path, "w")))  return EXIT_FAILURE;
+    for (int i = 0; i < count; i++) {
+        size_t nameLen = strcspn(prefs[i], "=");
+        fprintf(out, "%.*s %s\n", (int)nameLen, prefs[i], prefs[i][nameLen] ? prefs[i] + nameLen + 1 : "");
+    }
+    return fclose(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void runSync(const char *title, const int files) {
+    int result = -1;
+    pid_t pid;
+    vfsSimStatsReset();
+    double start = now();
+    // Sync in a forked child like JPilot does, so the plugin starts with fresh globals.
+    if (!(pid = fork())) {
+        result = plugin_sync(0);
+        plugin_post_sync();
+        exit(result);
+    } else if (pid > 0 && waitpid(pid, &result, 0) == pid)
+        result = WIFEXITED(result) ? WEXITSTATUS(result) : -1;
+    double wall = now() - start;
+    const vfsSimStats *stats = vfsSimStatsGet();
+    printf("%-10s %8d files: result=%d wall=%8.3fs roundTrips=%8ld bytesIn=%11lld bytesOut=%11lld modeled=%9.1fs\n",
+            title, files, result, wall, stats->calls, stats->bytesIn, stats->bytesOut, stats->modeledSecs);
+    fflush(stdout);
+}
+
+/* Time looking up each name of a dir of the given number of files, and as many missing ones, by the hash index and linearly. */
+static int benchNameIndex(const int files) {
+    dirListing list = {0};
+    nameIndex index, linear = {&list, 0, NULL}; // without slots nameIndexFind() scans linearly like before the index
+    char name[32];
+    int found[2] = {0, 0};
+    double secs[2];
+    for (int f = 0; f < files; f++) {
+        snprintf(name, sizeof(name), "photo_%06d.jpg", f);
+        if (dirListingAdd(&list, 0, name, strlen(name)))  return EXIT_FAILURE;
+    }
+    double start = now();
+    nameIndexBuild(&index, &list);
+    double build = now() - start;
+    for (int pass = 0; pass < 2; pass++) {
+        start = now();
+        for (int f = 0; f < 2 * files; f++) {
+            snprintf(name, sizeof(name), f < files ? "photo_%06d.jpg" : "photo_%06d.3gp", f % files);
+            found[pass] += nameIndexFind(pass ? &linear : &index, name) != NULL;
+        }
+        secs[pass] = now() - start;
+    }
+    printf("nameIndex  %8d files: found=%d/%d build=%8.3fms indexed=%8.3fus linear=%10.3fus per lookup, speedup=%.0fx\n",
+            files, found[0], found[1], build * 1e3, secs[0] * 1e6 / (2 * files), secs[1] * 1e6 / (2 * files), secs[1] / secs[0]);
+    nameIndexFree(&index);
+    dirListingFree(&list);
+    return found[0] == files && found[1] == files ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Add a file with the given size and date to the listing of a snapshot. */
+static int addFile(dirListing *list, const char *name, const long size, const time_t date) {
+    if (dirListingAdd(list, 0, name, strlen(name)))  return EXIT_FAILURE;
+    list->items[list->count - 1].size = size;
+    list->items[list->count - 1].date = date;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Diff a snapshot of 2 albums against the manifest of the former sync, in which all files had size 10, remote date 1000
+ * and local date 2000, and check, that the new, changed, removed and moved files, and only those, are planned.
+ */
+static int checkDiff(void) {
+    static const struct {int op; const char *album, *name, *source;} expected[] = {
+        {OP_RESTORE, "A", "removed.jpg", NULL}, // removed on the Palm, so restored like any file unknown there
+        {OP_RESTORE, "A", "added.jpg", NULL}, // new local file
+        {OP_BACKUP, "A", "changed.jpg", NULL}, // changed on the Palm, as its listed size differs from the manifest
+        {OP_BACKUP, "A", "edited.jpg", NULL}, // changed locally
+        {OP_BACKUP, "A", "new.jpg", NULL},
+        {OP_DATE_LOCAL, "A", "A", NULL},
+        {OP_MOVE_LOCAL, "B", "moved.jpg", "A"}, // moved from A to B on the Palm, which drops its restore to A
+        {OP_DATE_LOCAL, "B", "B", NULL}
+    };
+    static const char *synced[] = {"A/same.jpg", "A/changed.jpg", "A/edited.jpg", "A/removed.jpg", "A/moved.jpg"};
+    const int count = sizeof(expected) / sizeof(*expected);
+    char base[] = "/tmp/media-bench.XXXXXX", home[256], cmd[256];
+    rootSnapshot snap = {2};
+    syncPlan plan = {0};
+    syncContext *context;
+    albumSnapshot *a, *b;
+    int result = EXIT_FAILURE, errors = 0;
+
+    if (!mkdtemp(base)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(home, sizeof(home), "%s/.jpilot/%s", base, PACKAGE);
+    setenv("JPILOT_HOME", base, 1);
+    if (makeDirs(home) || !(context = syncContextNew(home))) {
+        fprintf(stderr, "Could not create context in '%s'\n", base);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < (int)(sizeof(synced) / sizeof(*synced)); i++) {
+        char rmPath[64];
+        snprintf(rmPath, sizeof(rmPath), "/DCIM/%s", synced[i]);
+        syncRecord(context, 2, rmPath, 10, 1000, 2000);
+    }
+    snap.rmRoot = strdup("/DCIM");
+    snap.lcRoot = strdup(home);
+    if (!snap.rmRoot || !snap.lcRoot || !(a = addAlbumSnapshot(&snap, "A", 1, 1))
+            || addFile(&a->rmList, "same.jpg", -1, 0) || addFile(&a->rmList, "changed.jpg", 14, 0)
+            || addFile(&a->rmList, "edited.jpg", -1, 0) || addFile(&a->rmList, "new.jpg", -1, 0)
+            || addFile(&a->lcList, "same.jpg", 10, 2000) || addFile(&a->lcList, "changed.jpg", 10, 2000)
+            || addFile(&a->lcList, "edited.jpg", 12, 3000) || addFile(&a->lcList, "removed.jpg", 10, 2000)
+            || addFile(&a->lcList, "moved.jpg", 10, 2000) || addFile(&a->lcList, "added.jpg", 10, 3000)
+            || !(b = addAlbumSnapshot(&snap, "B", 1, 1)) || addFile(&b->rmList, "moved.jpg", -1, 0)) {
+        fprintf(stderr, "Out of memory\n");
+    } else if ((result = syncDiff(context, &snap, &plan)) == EXIT_SUCCESS) {
+        for (int i = 0; i < MAX(count, plan.count); i++) {
+            const planItem *item = i < plan.count ? plan.items + i : NULL;
+            if (!item || i >= count || item->op != expected[i].op || strcmp(item->album->name, expected[i].album)
+                    || strcmp(item->name, expected[i].name) || (item->source ? !expected[i].source
+                            || strcmp(item->source->name, expected[i].source) : expected[i].source != NULL)) {
+                printf("diff item %d: op=%d album=%s name=%s, expected op=%d album=%s name=%s\n", i,
+                        item ? item->op : -1, item ? item->album->name : "", item ? item->name : "",
+                        i < count ? expected[i].op : -1, i < count ? expected[i].album : "", i < count ? expected[i].name : "");
+                errors++;
+            }
+        }
+        result = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    printf("diff       %8d items: %s\n", plan.count, result == EXIT_SUCCESS ? "OK" : "FAILED");
+    freePlan(&plan);
+    freeSnapshot(&snap);
+    syncContextFree(context);
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", base);
+    if (system(cmd))  fprintf(stderr, "Could not remove '%s'\n", base);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    vfsSimConfig config = {NULL, 2000, 115200, 0, 0, 0, 0};
+    int albums = 10, size = 1024, keep = 0, micro = 0, check = 0, opt, prefCount = 0;
+    char *prefs[argc];
+    int defaultFiles[] = {100, 1000, 10000, 100000};
+
+    glob_log_stdout_mask = JP_LOG_FATAL; // JP_LOG_WARN would print every synced file
+    while ((opt = getopt(argc, argv, "a:s:l:b:ricx:p:dkmth")) != -1) {
+        switch (opt) {
+            case 'a': albums = MAX(1, atoi(optarg)); break;
+            case 's': size = MAX(1, atoi(optarg)); break;
+            case 'l': config.latencyUs = atol(optarg); break;
+            case 'b': config.bandwidth = atol(optarg); break;
+            case 'r': config.realTime = 1; break;
+            case 'i': config.brokenIterator = 1; break;
+            case 'c': config.crashOnEmptyDir = 1; break;
+            case 'x': config.dropAfterBytes = atoll(optarg); break;
+            case 'p': prefs[prefCount++] = optarg; break;
+            case 'd': glob_log_stdout_mask |= JP_LOG_WARN | JP_LOG_DEBUG; break;
+            case 'k': keep = 1; break;
+            case 'm': micro = 1; break;
+            case 't': check = 1; break;
+            default: fputs(USAGE, stderr); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (micro)
+        return benchNameIndex(1000) | benchNameIndex(10000);
+    if (check)
+        return checkDiff();
+    for (int i = optind; i < argc || (optind == argc && i < optind + (int)(sizeof(defaultFiles) / sizeof(int))); i++) {
+        int files = optind < argc ? atoi(argv[i]) : defaultFiles[i - optind];
+        char base[] = "/tmp/media-bench.XXXXXX", root[256], home[256], cmd[256];
+        if (!mkdtemp(base)) {
+            perror("mkdtemp");
+            return EXIT_FAILURE;
+        }
+        snprintf(root, sizeof(root), "%s/palm", base);
+        snprintf(home, sizeof(home), "%s/home/.jpilot", base);
+        if (makeDirs(home) || createLibrary(root, files, albums, size, config.crashOnEmptyDir)
+                || (prefCount && writePrefs(home, prefs, prefCount))) {
+            fprintf(stderr, "Could not create library in '%s'\n", base);
+            return EXIT_FAILURE;
+        }
+        *strrchr(home, '/') = '\0';
+        setenv("JPILOT_HOME", home, 1);
+        config.root = root;
+        vfsSimInit(&config);
+        runSync("initial", files);
+        runSync("unchanged", files);
+        if (!keep) {
+            snprintf(cmd, sizeof(cmd), "rm -rf '%s'", base);
+            if (system(cmd))  fprintf(stderr, "Could not remove '%s'\n", base);
+        } else
+            printf("Kept files in '%s'\n", base);
+    }
+    return EXIT_SUCCESS;
+}
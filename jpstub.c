@@ -0,0 +1,150 @@
+/*******************************************************************************
+ * jpstub.c
+ *
+ * Minimal replacements for the libplugin functions of JPilot, which media.c uses,
+ * so the sync engine can run outside of JPilot.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libplugin.h"
+#include "jpstub.h"
+
+int glob_log_stdout_mask = JP_LOG_WARN | JP_LOG_FATAL;
+int glob_log_file_mask = 0; // as there is no log file
+int glob_log_gui_mask = 0;
+
+int jp_logf(int log_level, const char *format, ...) {
+    va_list args;
+    if (!(log_level & glob_log_stdout_mask))  return 0;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    return 0;
+}
+
+void jp_init(void) {
+}
+
+/* Same as in JPilot: $JPILOT_HOME/.jpilot/file, or $HOME/.jpilot/file. */
+int jp_get_home_file_name(const char *file, char *full_name, int max_size) {
+    const char *home = getenv("JPILOT_HOME");
+    if (!home && !(home = getenv("HOME")))
+        return EXIT_FAILURE;
+    if (snprintf(full_name, max_size, "%s/.jpilot/%s", home, file) >= max_size)
+        return -1;
+    return EXIT_SUCCESS;
+}
+
+int jp_get_pref(prefType prefs[], int which, long *n, const char **string) {
+    if (n)  *n = prefs[which].ivalue;
+    if (string)  *string = prefs[which].svalue;
+    return EXIT_SUCCESS;
+}
+
+int jp_set_pref(prefType prefs[], int which, long n, const char *string) {
+    prefs[which].ivalue = n;
+    if (string) {
+        char *svalue;
+        if (!(svalue = strdup(string)))  return EXIT_FAILURE;
+        free(prefs[which].svalue);
+        prefs[which].svalue = svalue;
+        prefs[which].svalue_size = strlen(svalue) + 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Set a pref from a "name value" string, as found in the rc file or on the command line. */
+int jpStubSetPref(prefType prefs[], int num_prefs, const char *name, const char *value) {
+    for (int i = 0; i < num_prefs; i++) {
+        if (!strcmp(prefs[i].name, name)) {
+            return prefs[i].usertype == INTTYPE ?
+                    jp_set_pref(prefs, i, atol(value), NULL) : jp_set_pref(prefs, i, 0, value);
+        }
+    }
+    return -1;
+}
+
+/* Prefs from the command line, which override the rc file, but are not written to it. */
+#define MAX_OVERRIDES 32
+static struct {const char *name, *value; char *fileValue;} overrides[MAX_OVERRIDES];
+static int overrideCount;
+
+int jpStubOverridePref(const char *name, const char *value) {
+    if (overrideCount >= MAX_OVERRIDES)  return -1;
+    overrides[overrideCount].name = name;
+    overrides[overrideCount++].value = value;
+    return EXIT_SUCCESS;
+}
+
+/* Print pref as line "name value", for an overridden pref with the value from the rc file. */
+static void printPref(FILE *out, const prefType *pref) {
+    for (int i = 0; i < overrideCount; i++) {
+        if (!strcmp(overrides[i].name, pref->name) && overrides[i].fileValue) {
+            fprintf(out, "%s %s\n", pref->name, overrides[i].fileValue);
+            return;
+        }
+    }
+    if (pref->usertype == INTTYPE)
+        fprintf(out, "%s %ld\n", pref->name, pref->ivalue);
+    else
+        fprintf(out, "%s %s\n", pref->name, pref->svalue ? pref->svalue : "");
+}
+
+int jp_pref_read_rc_file(const char *filename, prefType prefs[], int num_prefs) {
+    char path[FILENAME_MAX], line[1024];
+    FILE *in = NULL;
+    int result = -1;
+
+    if (!jp_get_home_file_name(filename, path, sizeof(path)) && (in = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), in)) {
+            char *value = strchr(line, ' ');
+            line[strcspn(line, "\r\n")] = '\0';
+            if (value)  *value++ = '\0';
+            jpStubSetPref(prefs, num_prefs, line, value ? value : "");
+        }
+        fclose(in);
+        result = EXIT_SUCCESS;
+    }
+    for (int i = 0; i < overrideCount; i++) {
+        for (int p = 0; p < num_prefs && !overrides[i].fileValue; p++) { // remember the value to write back
+            char number[24];
+            if (strcmp(prefs[p].name, overrides[i].name))  continue;
+            snprintf(number, sizeof(number), "%ld", prefs[p].ivalue);
+            overrides[i].fileValue = strdup(prefs[p].usertype == INTTYPE ? number : prefs[p].svalue ? prefs[p].svalue : "");
+        }
+        if (jpStubSetPref(prefs, num_prefs, overrides[i].name, overrides[i].value))
+            fprintf(stderr, "Unknown pref '%s'\n", overrides[i].name);
+    }
+    return result;
+}
+
+int jp_pref_write_rc_file(const char *filename, prefType prefs[], int num_prefs) {
+    char path[FILENAME_MAX];
+    FILE *out;
+
+    if (jp_get_home_file_name(filename, path, sizeof(path)) || !(out = fopen(path, "w")))
+        return -1;
+    for (int i = 0; i < num_prefs; i++)
+        printPref(out, prefs + i);
+    return fclose(out) ? -1 : EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+/*******************************************************************************
+ * jpstub.h
+ *
+ * Minimal replacements for the libplugin functions of JPilot, which media.c uses,
+ * so the sync engine can run outside of JPilot.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#ifndef __JPSTUB_H__
+#define __JPSTUB_H__
+
+#include "libplugin.h"
+#include "log.h" // glob_log_stdout_mask holds the log levels, which jp_logf() prints to stderr.
+
+int jpStubSetPref(prefType prefs[], int num_prefs, const char *name, const char *value);
+
+/* Override a pref of the rc file by the command line, without writing it to the file. */
+int jpStubOverridePref(const char *name, const char *value);
+
+#endif
@@ -21,12 +21,23 @@
 
 #include "config.h"
 
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <utime.h>
 
 #include <pi-dlp.h>
@@ -34,18 +45,37 @@
 #include <pi-util.h>
 
 #include "libplugin.h"
+#include "log.h"
 //#include "i18n.h"
+#include "media.h"
 
 #define MYNAME PACKAGE_NAME
 #define PCDIR MYNAME
 #define PREFS_VERSION 3
 #define ADDITIONAL_FILES "/#AdditionalFiles"
+#define MANIFEST_FILE "/.syncManifest"
+#define ITERATORS_FILE "/.dirIterators"
+#define CHUNKS_FILE "/.chunkSizes"
+#define STATS_FILE "/.syncStats"
+#define TRACE_FILE "/.syncTrace"
+#define CATALOG_FILE "/.catalog"
+#define PARTIALS_FILE "/.partialTransfers"
+#define PART_SUFFIX ".part"
+#define JOURNAL_FILE "/.syncJournal"
 
 #define L_DEBUG JP_LOG_DEBUG
 #define L_INFO  JP_LOG_WARN // JP_LOG_INFO unfortunately doesn't show up in GUI, so use JP_LOG_WARN.
 #define L_WARN  JP_LOG_WARN
 #define L_FATAL JP_LOG_FATAL
 #define L_GUI   JP_LOG_GUI
+#ifdef NO_TRACE
+#define TRACE_ON 0 // the debug log and the trace are compiled out
+#else
+#define TRACE_ON 1
+#endif
+// Only format the arguments of the debug log, if it goes anywhere, i.e. with 'jpilot -d'.
+#define DEBUG_ON (TRACE_ON && ((glob_log_stdout_mask | glob_log_file_mask | glob_log_gui_mask) & L_DEBUG))
+#define logDebug(...) do { if (DEBUG_ON)  jp_logf(L_DEBUG, __VA_ARGS__); } while (0)
 
 typedef struct VFSInfo VFSInfo;
 typedef struct VFSDirInfo VFSDirInfo;
@@ -65,7 +95,7 @@ For more documentation, bug reports and new versions,\n\
 see https://github.com/CoSoCo/JPilotMediaPlugin";
 
 static const char *PREFS_FILE = PACKAGE".rc";
-static prefType prefs[] = {
+static prefType PREFS[] = { // copied into the context of each sync
     {"prefsVersion", INTTYPE, INTTYPE, PREFS_VERSION, NULL, 0},
     {"rootDirs", CHARTYPE, CHARTYPE, 0, "1>/Photos & Videos:1>/Fotos & Videos:/DCIM", 0},
     {"syncThumbnailDir", INTTYPE, INTTYPE, 0, NULL, 0},
@@ -83,36 +113,268 @@ static prefType prefs[] = {
     {"listFiles", INTTYPE, INTTYPE, 0, NULL, 0},
     {"excludeDirs", CHARTYPE, CHARTYPE, 0, "/BLAZER:2>/PALM/Launcher", 0},
     {"deleteFiles", CHARTYPE, CHARTYPE, 0, NULL, 0},
-    {"additionalFiles", CHARTYPE, CHARTYPE, 0, NULL, 0}
+    {"additionalFiles", CHARTYPE, CHARTYPE, 0, NULL, 0},
+    {"useManifest", INTTYPE, INTTYPE, 1, NULL, 0},
+    {"chunkSize", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"dryRun", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"scheduleOrder", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"maxSyncSecs", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"maxSyncBytes", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"traceSync", INTTYPE, INTTYPE, 0, NULL, 0},
+    {"listDetails", INTTYPE, INTTYPE, 1, NULL, 0},
+    {"albumDepth", INTTYPE, INTTYPE, 1, NULL, 0}
 };
-static const unsigned NUM_PREFS = sizeof(prefs)/sizeof(prefType);
-static long prefsVersion;
-static char *rootDirs; // becomes freed by jp_free_prefs()
-static long syncThumbnailDir;
-static char *fileTypes; // becomes freed by jp_free_prefs()
-static long useDateModified;
-static long compareContent;
-static long doBackup;
-static long doRestore;
-static long listFiles;
-static char *excludeDirs; // becomes freed by jp_free_prefs()
-static char *deleteFiles; // becomes freed by jp_free_prefs()
-static char *additionalFiles; // becomes freed by jp_free_prefs()
+static const unsigned NUM_PREFS = sizeof(PREFS)/sizeof(prefType);
 
 static const unsigned MAX_VOLUMES = 16;
-static const unsigned MIN_DIR_ITEMS = 2;
-static const unsigned MAX_DIR_ITEMS = 1024;
+static const unsigned DIR_BATCH = 256;
+static const int DIR_BATCH_MAX = 1024; // limit of the growing batch on broken dir iterators
+#define NAME_CHUNK 8192
+#define CHUNK_SHIFT 10 // smallest transfer chunk is 1 KiB
+#define CHUNK_SIZES 7 // ... up to 64 KiB
+#define CHUNK_MAX (1 << (CHUNK_SHIFT + CHUNK_SIZES - 1))
+#define CHUNK_DEFAULT 5 // 32 KiB, fixed before chunk sizes were tuned
+#define CHUNK_PROBE (256 * 1024) // bytes to transfer, before judging a chunk size
+#define RING_BUFFERS 4
+#define POOL_THREADS 2
 static const char *LOCALDIRS[] = {"/Internal", "/SDCard", "/Card"};
-static fullPath *rootDirList = NULL;
-static fullPath *fileTypeList = NULL;
-static fullPath *excludeDirList = NULL;
-static fullPath *deleteFileList = NULL;
-static fullPath *additionalFileList = NULL;
-static pi_buffer_t *piBuf, *piBuf2;
-static int sd; // The central socket descriptor.
-static char mediaHome[NAME_MAX];
-static char syncLogEntry[128];
-static int importantWarning = 0;
+
+static double monotonicSecs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Instrumentation of the DLP calls and the local file I/O, to find out, where a HotSync spends its time.
+ * Each call is counted and timed by its type, and its latency is sorted into a histogram of power of 2 microseconds,
+ * from which the percentiles are estimated. Read and write calls also account their bytes.
+ * The summary goes to the debug log and to file mediaHome/STATS_FILE as tab separated lines per call type,
+ * followed by the totals of all DLP calls and the wall time of the sync.
+ */
+enum callType {
+    CALL_READ_USER_INFO, CALL_ADD_SYNC_LOG_ENTRY, CALL_VOLUME_ENUMERATE, CALL_VOLUME_INFO, CALL_DIR_CREATE, CALL_DIR_ENTRY_ENUMERATE,
+    CALL_FILE_OPEN, CALL_FILE_CLOSE, CALL_FILE_CREATE, CALL_FILE_DELETE, CALL_FILE_RENAME, CALL_FILE_READ, CALL_FILE_WRITE, CALL_FILE_SEEK,
+    CALL_FILE_SIZE, CALL_FILE_GET_DATE, CALL_FILE_SET_DATE, CALL_FILE_GET_ATTRIBUTES,
+    CALL_STAT, CALL_FOPEN, CALL_FREAD, CALL_FWRITE, CALL_TYPES
+};
+static const char *CALL_NAMES[] = {
+    "dlp_ReadUserInfo", "dlp_AddSyncLogEntry", "dlp_VFSVolumeEnumerate", "dlp_VFSVolumeInfo", "dlp_VFSDirCreate", "dlp_VFSDirEntryEnumerate",
+    "dlp_VFSFileOpen", "dlp_VFSFileClose", "dlp_VFSFileCreate", "dlp_VFSFileDelete", "dlp_VFSFileRename", "dlp_VFSFileRead", "dlp_VFSFileWrite", "dlp_VFSFileSeek",
+    "dlp_VFSFileSize", "dlp_VFSFileGetDate", "dlp_VFSFileSetDate", "dlp_VFSFileGetAttributes",
+    "stat", "fopen", "fread", "fwrite"
+};
+#define LATENCY_BUCKETS 32 // up to 2^32 us
+typedef struct callStats {long calls; double secs; long long bytes; long buckets[LATENCY_BUCKETS];} callStats;
+/*
+ * Trace of the last TRACE_EVENTS calls and operations of a sync, as compact binary events in a ring buffer, so recording
+ * an event costs no formatting. It is kept, if pref traceSync is set, and only written as text to mediaHome/TRACE_FILE,
+ * if the sync fails or traceSync is 2. Events of kind < CALL_TYPES are the timed calls, the others are listed below.
+ */
+#define TRACE_EVENTS 4096
+#define TRACE_NAME 28 // tail of the path
+enum traceKind {TRACE_ENUMERATE = CALL_TYPES, TRACE_ALBUM, TRACE_DEFERRED, TRACE_PLAN_OP}; // TRACE_PLAN_OP + planOp
+static const char *TRACE_NAMES[] = {"enumerate", "album", "deferred"};
+typedef struct traceEvent {float at, secs; int16_t kind, volRef; int32_t result; int64_t bytes; char name[TRACE_NAME];} traceEvent;
+/*
+ * The state of the sync with one Palm device. All functions work on the context of their thread, which syncDevice()
+ * sets for the sync, and which the pool and copy threads take over, so several devices can be synced at once from
+ * separate threads. The types of the parts are described at the functions, which work on them.
+ */
+typedef struct poolTask {
+    void (*run)(struct poolTask *task);
+    struct poolTask *next;
+    int fence, detached, done; // detached: freed by the pool after run, otherwise to be awaited by poolWait()
+} poolTask;
+typedef struct remoteMeta {char *key; int flags; time_t date; unsigned long attr; long size;} remoteMeta;
+typedef struct volIterator {unsigned long userID; int volRef; int strategy;} volIterator;
+typedef struct chunkTuner {
+    unsigned long userID; int volRef; int direction;
+    double rates[CHUNK_SIZES]; // bytes per second, 0 = not yet measured
+    int current; long bytes; double secs; // the size in probe and its measurement
+} chunkTuner;
+typedef struct partial {int kind; int volRef; int size; time_t date; char *rmPath; char *lcPath;} partial;
+typedef struct manifestEntry {uint32_t keyOffset; int32_t size; int64_t rmDate; int64_t lcDate;} manifestEntry;
+typedef struct manifestUpdate {char *key; int32_t size; int64_t rmDate; int64_t lcDate;} manifestUpdate;
+typedef struct journalEntry {int kind; time_t rmDate, lcDate; char *key;} journalEntry;
+typedef struct syncContext {
+    int sd; // The central socket descriptor.
+    prefType prefs[sizeof(PREFS) / sizeof(prefType)];
+    long prefsVersion;
+    char *rootDirs; // becomes freed by jp_free_prefs()
+    long syncThumbnailDir;
+    char *fileTypes; // becomes freed by jp_free_prefs()
+    long useDateModified;
+    long compareContent;
+    long doBackup;
+    long doRestore;
+    long listFiles;
+    char *excludeDirs; // becomes freed by jp_free_prefs()
+    char *deleteFiles; // becomes freed by jp_free_prefs()
+    char *additionalFiles; // becomes freed by jp_free_prefs()
+    long useManifest;
+    long chunkSize;
+    long dryRun;
+    long scheduleOrder;
+    long maxSyncSecs;
+    long maxSyncBytes;
+    long traceSync;
+    long listDetails;
+    long albumDepth;
+    fullPath *rootDirList, *fileTypeList, *excludeDirList, *deleteFileList, *additionalFileList;
+    struct typeMatcher {struct typeSlot *slots; unsigned mask;} fileTypeMatcher; // compiled from fileTypeList
+    struct pathTrie {struct trieNode *nodes; int count, allocated; char *names; int *rules; int ruleCount;} excludeTrie; // compiled from excludeDirList
+    pi_buffer_t *piBuf, *piBuf2;
+    pi_buffer_t *ringBufs[RING_BUFFERS];
+    char mediaHome[NAME_MAX];
+    char localRoot[NAME_MAX]; // as returned by localRoot()
+    char syncLogEntry[128];
+    unsigned long userID; // identifies the Palm device
+    int importantWarning;
+    double syncStart; // for the time budget of the sync
+    callStats callStatsTable[CALL_TYPES];
+    pthread_mutex_t callStatsLock; // as local I/O also runs in the copy and pool threads, also guards the trace
+    struct {traceEvent *events; unsigned long next;} trace; // events NULL, if not tracing
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        pthread_t threads[POOL_THREADS];
+        int started, stop;
+        poolTask *head, *tail;
+        int running, fenced;
+    } pool;
+    struct {
+        remoteMeta *slots;
+        unsigned mask, used;
+        struct cachedVolume {int volRef; VFSInfo volInfo;} *volumes;
+        int volumeCount;
+        long hits, misses, savedCalls;
+    } metaCache;
+    struct {volIterator *items; int count; int changed;} volIterators;
+    struct {chunkTuner *items; int count; int changed;} chunkTuners;
+    chunkTuner *readTuner, *writeTuner; // of the volume in copy
+    struct {partial *items; int count;} partials;
+    struct {
+        void *map;
+        size_t mapSize;
+        const manifestEntry *entries;
+        const char *keys;
+        uint32_t count;
+        manifestUpdate *updates;
+        unsigned updated, allocated;
+        unsigned char *dropped; // bits of the entries, which manifestSave() drops
+        unsigned droppedCount;
+    } manifest;
+    struct {journalEntry *items; int count; FILE *fileP; int torn, opened, incomplete;} journal;
+    pthread_mutex_t journalLock; // as the albums are recorded by the pool
+} syncContext;
+static __thread syncContext *ctx; // of the calling thread
+
+/* Record an event into the trace ring, overwriting the oldest one. Must hold callStatsLock. */
+static void traceLocked(const int kind, const int volRef, const long result, const long long bytes, const char *name,
+        const double start, const double secs) {
+    traceEvent *event = ctx->trace.events + ctx->trace.next++ % TRACE_EVENTS;
+    size_t length = name ? strlen(name) : 0, kept = MIN(length, TRACE_NAME - 1);
+    *event = (traceEvent){start - ctx->syncStart, secs, kind, volRef, result, bytes, ""};
+    if (kept)  memcpy(event->name, name + length - kept, kept);
+}
+
+static void traceAdd(const int kind, const int volRef, const long result, const long long bytes, const char *name) {
+    double now = monotonicSecs();
+    pthread_mutex_lock(&ctx->callStatsLock);
+    traceLocked(kind, volRef, result, bytes, name, now, 0);
+    pthread_mutex_unlock(&ctx->callStatsLock);
+}
+
+#define TRACE(kind, volRef, result, bytes, name) do { if (TRACE_ON && ctx->trace.events)  traceAdd(kind, volRef, result, bytes, name); } while (0)
+
+static long callDone(const int type, const double start, const long bytes) {
+    double secs = monotonicSecs() - start;
+    int bucket = 0;
+    for (long us = (long)(secs * 1e6); us > 1 && bucket < LATENCY_BUCKETS - 1; us >>= 1)  bucket++;
+    pthread_mutex_lock(&ctx->callStatsLock);
+    if (TRACE_ON && ctx->trace.events)
+        traceLocked(type, -1, 0, bytes, NULL, start, secs);
+    callStats *stats = ctx->callStatsTable + type;
+    stats->calls++;
+    stats->secs += secs;
+    if (bytes > 0)  stats->bytes += bytes;
+    stats->buckets[bucket]++;
+    pthread_mutex_unlock(&ctx->callStatsLock);
+    return bytes;
+}
+
+#define TIMED(type, call) ({double start_ = monotonicSecs(); __typeof__(call) result_ = (call); callDone(type, start_, 0); result_;})
+#define TIMED_IO(type, call) ({double start_ = monotonicSecs(); __typeof__(call) result_ = (call); callDone(type, start_, result_); result_;})
+#define dlp_ReadUserInfo(...) TIMED(CALL_READ_USER_INFO, dlp_ReadUserInfo(__VA_ARGS__))
+#define dlp_AddSyncLogEntry(...) TIMED(CALL_ADD_SYNC_LOG_ENTRY, dlp_AddSyncLogEntry(__VA_ARGS__))
+#define dlp_VFSVolumeEnumerate(...) TIMED(CALL_VOLUME_ENUMERATE, dlp_VFSVolumeEnumerate(__VA_ARGS__))
+#define dlp_VFSVolumeInfo(...) TIMED(CALL_VOLUME_INFO, dlp_VFSVolumeInfo(__VA_ARGS__))
+#define dlp_VFSDirCreate(...) TIMED(CALL_DIR_CREATE, dlp_VFSDirCreate(__VA_ARGS__))
+#define dlp_VFSDirEntryEnumerate(...) TIMED(CALL_DIR_ENTRY_ENUMERATE, dlp_VFSDirEntryEnumerate(__VA_ARGS__))
+#define dlp_VFSFileOpen(...) TIMED(CALL_FILE_OPEN, dlp_VFSFileOpen(__VA_ARGS__))
+#define dlp_VFSFileClose(...) TIMED(CALL_FILE_CLOSE, dlp_VFSFileClose(__VA_ARGS__))
+#define dlp_VFSFileCreate(...) TIMED(CALL_FILE_CREATE, dlp_VFSFileCreate(__VA_ARGS__))
+#define dlp_VFSFileDelete(...) TIMED(CALL_FILE_DELETE, dlp_VFSFileDelete(__VA_ARGS__))
+#define dlp_VFSFileRename(...) TIMED(CALL_FILE_RENAME, dlp_VFSFileRename(__VA_ARGS__))
+#define dlp_VFSFileRead(...) TIMED_IO(CALL_FILE_READ, dlp_VFSFileRead(__VA_ARGS__))
+#define dlp_VFSFileWrite(...) TIMED_IO(CALL_FILE_WRITE, dlp_VFSFileWrite(__VA_ARGS__))
+#define dlp_VFSFileSeek(...) TIMED(CALL_FILE_SEEK, dlp_VFSFileSeek(__VA_ARGS__))
+#define dlp_VFSFileSize(...) TIMED(CALL_FILE_SIZE, dlp_VFSFileSize(__VA_ARGS__))
+#define dlp_VFSFileGetDate(...) TIMED(CALL_FILE_GET_DATE, dlp_VFSFileGetDate(__VA_ARGS__))
+#define dlp_VFSFileSetDate(...) TIMED(CALL_FILE_SET_DATE, dlp_VFSFileSetDate(__VA_ARGS__))
+#define dlp_VFSFileGetAttributes(...) TIMED(CALL_FILE_GET_ATTRIBUTES, dlp_VFSFileGetAttributes(__VA_ARGS__))
+#define stat(path, buf) TIMED(CALL_STAT, stat(path, buf))
+#define fopen(path, mode) TIMED(CALL_FOPEN, fopen(path, mode))
+#define fread(ptr, size, n, fileP) TIMED_IO(CALL_FREAD, fread(ptr, size, n, fileP))
+#define fwrite(ptr, size, n, fileP) TIMED_IO(CALL_FWRITE, fwrite(ptr, size, n, fileP))
+
+/* Estimate the percentile p of the latencies from the histogram, as the upper bound of its bucket in seconds. */
+static double callPercentile(const callStats *stats, const double p) {
+    long count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if ((count += stats->buckets[i]) >= p * stats->calls)
+            return MIN((double)(2L << i) / 1e6, stats->secs); // not more than all calls together
+    }
+    return stats->secs;
+}
+
+/* Log the summary of the calls and write it to mediaHome/STATS_FILE, if not a dry run. */
+void reportCallStats(const double syncSecs) {
+    char path[NAME_MAX + sizeof(STATS_FILE)];
+    FILE *fileP;
+    callStats dlp = {0};
+
+    if (ctx->dryRun)
+        fileP = NULL; // as a dry run doesn't change anything
+    else if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), STATS_FILE), "w")))
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing sync statistics\n", MYNAME, path);
+    else
+        fprintf(fileP, "call\tcalls\tsecs\tp50_secs\tp99_secs\tbytes\n");
+    logDebug("%s: %-26s %8s %10s %10s %10s %12s\n", MYNAME, "Call", "calls", "secs", "p50 secs", "p99 secs", "bytes");
+    for (int type = 0; type < CALL_TYPES; type++) {
+        callStats *stats = ctx->callStatsTable + type;
+        if (!stats->calls)  continue;
+        double p50 = callPercentile(stats, 0.5), p99 = callPercentile(stats, 0.99);
+        logDebug("%s: %-26s %8ld %10.3f %10.6f %10.6f %12lld\n", MYNAME, CALL_NAMES[type], stats->calls, stats->secs, p50, p99, stats->bytes);
+        if (fileP)
+            fprintf(fileP, "%s\t%ld\t%.6f\t%.6f\t%.6f\t%lld\n", CALL_NAMES[type], stats->calls, stats->secs, p50, p99, stats->bytes);
+        if (type < CALL_STAT) {
+            dlp.calls += stats->calls;
+            dlp.secs += stats->secs;
+        }
+    }
+    long long bytesIn = ctx->callStatsTable[CALL_FILE_READ].bytes, bytesOut = ctx->callStatsTable[CALL_FILE_WRITE].bytes;
+    double transferSecs = ctx->callStatsTable[CALL_FILE_READ].secs + ctx->callStatsTable[CALL_FILE_WRITE].secs;
+    double throughput = transferSecs > 0 ? (bytesIn + bytesOut) / transferSecs : 0;
+    logDebug("%s: DLP: %ld calls in %.3f s of %.3f s sync, %lld bytes in, %lld bytes out, %.0f bytes/s\n",
+            MYNAME, dlp.calls, dlp.secs, syncSecs, bytesIn, bytesOut, throughput);
+    if (fileP) {
+        fprintf(fileP, "dlp\t%ld\t%.6f\t\t\t%lld\n", dlp.calls, dlp.secs, bytesIn + bytesOut);
+        fprintf(fileP, "sync\t\t%.6f\t\t\t\n", syncSecs);
+        fclose(fileP);
+    }
+}
 
 
 /* Log OOM error on malloc(). */
@@ -124,8 +386,8 @@ static void *mallocLog(size_t size) {
 }
 
 static char *errString(const int isPiErr, const int err, const int level, const char message[]) {
-    static char string[128];
-    PI_ERR piOSErr = (isPiErr && err == PI_ERR_DLP_PALMOS) ? pi_palmos_error(sd) : 0;
+    static __thread char string[128];
+    PI_ERR piOSErr = (isPiErr && err == PI_ERR_DLP_PALMOS) ? pi_palmos_error(ctx->sd) : 0;
     switch (piOSErr) {
         case 10760 : message = ": Not found the file"; break;
         case 10761 : message = ": The volume № is invalid;"; break;
@@ -175,7 +437,7 @@ int parsePaths(char *paths, fullPath **list, const char *prefName) {
             (*list) = NULL;
             return EXIT_FAILURE;
         }
-        jp_logf(L_DEBUG, "%s: Got %s item: '%s' for Volume %d\n", MYNAME, prefName, (*list)->name, (*list)->volRef);
+        logDebug("%s: Got %s item: '%s' for Volume %d\n", MYNAME, prefName, (*list)->name, (*list)->volRef);
         if (last == paths)
             break;
     }
@@ -183,8 +445,9 @@ int parsePaths(char *paths, fullPath **list, const char *prefName) {
 }
 
 char *isoTime(const time_t time) {
-    static char isoTime[20];
-    strftime(isoTime, 20, "%F %T", localtime (&time));
+    static __thread char isoTime[20]; // as also used by the worker threads
+    struct tm tm;
+    strftime(isoTime, 20, "%F %T", localtime_r(&time, &tm));
     return isoTime;
 }
 
@@ -208,31 +471,264 @@ void setLocalDate(const char *path, const time_t date) {
         utim.actime = (time_t)fstat.st_atime;
         utim.modtime = date;
         statErr = utime(path, &utim);
-        jp_logf(L_DEBUG, "%s:       setLocalDate(path='%s', date='%s') ---> done!\n", MYNAME, path, isoTime(date));
+        logDebug("%s:       setLocalDate(path='%s', date='%s') ---> done!\n", MYNAME, path, isoTime(date));
+    }
+}
+
+/*
+ * Pool of worker threads for the local side work, i.e. indexing the local albums and setting the local dates, so it
+ * runs while the sync thread waits for the Palm. The tasks start in the order of submission; a task with fence starts
+ * after all tasks before have finished and runs alone, so i.e. a dir date is set after the dates of its files.
+ * Without threads the tasks run in the submitting thread.
+ */
+
+static void *poolWorker(void *arg) {
+    ctx = arg;
+    pthread_mutex_lock(&ctx->pool.lock);
+    while (!ctx->pool.stop || ctx->pool.head) {
+        poolTask *task = ctx->pool.head;
+        if (!task || ctx->pool.fenced || (task->fence && ctx->pool.running)) {
+            pthread_cond_wait(&ctx->pool.changed, &ctx->pool.lock);
+            continue;
+        }
+        if (!(ctx->pool.head = task->next))  ctx->pool.tail = NULL;
+        ctx->pool.running++;
+        ctx->pool.fenced = task->fence;
+        pthread_mutex_unlock(&ctx->pool.lock);
+        task->run(task);
+        pthread_mutex_lock(&ctx->pool.lock);
+        ctx->pool.running--;
+        ctx->pool.fenced = 0;
+        if (task->detached)
+            free(task);
+        else
+            task->done = 1;
+        pthread_cond_broadcast(&ctx->pool.changed);
+    }
+    pthread_mutex_unlock(&ctx->pool.lock);
+    return NULL;
+}
+
+static void poolSubmit(poolTask *task) {
+    task->next = NULL;
+    task->done = 0;
+    pthread_mutex_lock(&ctx->pool.lock);
+    for (; !ctx->pool.stop && ctx->pool.started < POOL_THREADS; ctx->pool.started++) { // start on first use
+        if (pthread_create(ctx->pool.threads + ctx->pool.started, NULL, poolWorker, ctx))  break;
+    }
+    if (!ctx->pool.started) {
+        pthread_mutex_unlock(&ctx->pool.lock);
+        task->run(task);
+        if (task->detached)  free(task);
+        else  task->done = 1;
+        return;
+    }
+    if (ctx->pool.tail)
+        ctx->pool.tail->next = task;
+    else
+        ctx->pool.head = task;
+    ctx->pool.tail = task;
+    pthread_cond_broadcast(&ctx->pool.changed);
+    pthread_mutex_unlock(&ctx->pool.lock);
+}
+
+static void poolWait(poolTask *task) {
+    pthread_mutex_lock(&ctx->pool.lock);
+    while (!task->done)  pthread_cond_wait(&ctx->pool.changed, &ctx->pool.lock);
+    pthread_mutex_unlock(&ctx->pool.lock);
+}
+
+/* Wait until all submitted tasks have finished. */
+static void poolDrain(void) {
+    pthread_mutex_lock(&ctx->pool.lock);
+    while (ctx->pool.head || ctx->pool.running)  pthread_cond_wait(&ctx->pool.changed, &ctx->pool.lock);
+    pthread_mutex_unlock(&ctx->pool.lock);
+}
+
+/* Finish all tasks and end the threads. */
+static void poolStop(void) {
+    pthread_mutex_lock(&ctx->pool.lock);
+    ctx->pool.stop = 1;
+    pthread_cond_broadcast(&ctx->pool.changed);
+    pthread_mutex_unlock(&ctx->pool.lock);
+    for (int i = 0; i < ctx->pool.started; i++)
+        pthread_join(ctx->pool.threads[i], NULL);
+    ctx->pool.started = ctx->pool.stop = 0;
+}
+
+typedef struct dateTask {poolTask task; time_t date; char path[];} dateTask;
+
+static void runDateTask(poolTask *task) {
+    dateTask *dt = (dateTask *)task;
+    setLocalDate(dt->path, dt->date);
+}
+
+/* Set the date of the local file or dir path by the pool; with fence after the dates submitted before. */
+void queueLocalDate(const char *path, const time_t date, const int fence) {
+    dateTask *dt = malloc(sizeof(dateTask) + strlen(path) + 1);
+    if (!dt) { // so do it now
+        setLocalDate(path, date);
+        return;
+    }
+    dt->task = (poolTask){.run = runDateTask, .fence = fence, .detached = 1};
+    dt->date = date;
+    strcpy(dt->path, path);
+    poolSubmit(&dt->task);
+}
+
+static unsigned hashName(const char *name) {
+    unsigned hash = 2166136261u; // FNV-1a
+    while (*name)  hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+/*
+ * Session-scoped cache of remote metadata, to not ask the Palm again for the same things during one sync.
+ * Entries are keyed by "volRef:path" and are updated or invalidated on our own writes.
+ * Each hit accounts the DLP round trips, which it saved.
+ */
+enum {META_EXISTS = 1, META_DATE = 2, META_ATTR = 4, META_SIZE = 8};
+
+static remoteMeta *metaFind(const int volRef, const char *path, const int create) {
+    char key[NAME_MAX + 12];
+    snprintf(key, sizeof(key), "%d:%s", volRef, path);
+    if (create && 2 * (ctx->metaCache.used + 1) > ctx->metaCache.mask + 1) { // keep load factor <= 0.5
+        unsigned size = ctx->metaCache.slots ? 2 * (ctx->metaCache.mask + 1) : 256;
+        remoteMeta *slots = calloc(size, sizeof(*slots)), *old = ctx->metaCache.slots;
+        if (!slots)  return NULL;
+        for (unsigned i = 0; old && i <= ctx->metaCache.mask; i++) {
+            if (!old[i].key)  continue;
+            unsigned slot = hashName(old[i].key) & (size - 1);
+            while (slots[slot].key)  slot = (slot + 1) & (size - 1);
+            slots[slot] = old[i];
+        }
+        free(old);
+        ctx->metaCache.slots = slots;
+        ctx->metaCache.mask = size - 1;
+    }
+    if (!ctx->metaCache.slots)  return NULL;
+    unsigned slot = hashName(key) & ctx->metaCache.mask;
+    for (; ctx->metaCache.slots[slot].key; slot = (slot + 1) & ctx->metaCache.mask) {
+        if (!strcmp(key, ctx->metaCache.slots[slot].key))  return ctx->metaCache.slots + slot;
+    }
+    if (!create || !(ctx->metaCache.slots[slot].key = strdup(key)))  return NULL;
+    ctx->metaCache.used++;
+    return ctx->metaCache.slots + slot;
+}
+
+/* Returns the cached entry, if it has all the given flags, and accounts the saved round trips. */
+static remoteMeta *metaGet(const int volRef, const char *path, const int flags, const int calls) {
+    remoteMeta *meta = metaFind(volRef, path, 0);
+    if (meta && (meta->flags & flags) == flags) {
+        ctx->metaCache.hits++;
+        ctx->metaCache.savedCalls += calls;
+        return meta;
+    }
+    ctx->metaCache.misses++;
+    return NULL;
+}
+
+static void metaPut(const int volRef, const char *path, const int flags, const time_t date, const unsigned long attr, const long size) {
+    remoteMeta *meta = metaFind(volRef, path, 1);
+    if (!meta)  return;
+    meta->flags |= flags | META_EXISTS;
+    if (flags & META_DATE)  meta->date = date;
+    if (flags & META_ATTR)  meta->attr = attr;
+    if (flags & META_SIZE)  meta->size = size;
+}
+
+/* Invalidate the given flags of path; the date of its parent dir too, as it changes with the dir's content. */
+static void metaInvalidate(const int volRef, const char *path, const int flags) {
+    remoteMeta *meta = metaFind(volRef, path, 0);
+    if (meta)  meta->flags &= ~flags;
+    const char *slash = strrchr(path, '/');
+    if (slash && slash > path) {
+        char parent[slash - path + 1];
+        memcpy(parent, path, slash - path);
+        parent[slash - path] = '\0';
+        if ((meta = metaFind(volRef, parent, 0)))
+            meta->flags &= ~META_DATE;
+    }
+}
+
+PI_ERR getVolumeInfo(const int volRef, VFSInfo *volInfo) {
+    struct cachedVolume *volumes;
+    for (int i = 0; i < ctx->metaCache.volumeCount; i++) {
+        if (ctx->metaCache.volumes[i].volRef == volRef) {
+            ctx->metaCache.hits++;
+            ctx->metaCache.savedCalls++;
+            *volInfo = ctx->metaCache.volumes[i].volInfo;
+            return 0;
+        }
     }
+    ctx->metaCache.misses++;
+    PI_ERR piErr = dlp_VFSVolumeInfo(ctx->sd, volRef, volInfo);
+    if (piErr >= 0 && (volumes = realloc(ctx->metaCache.volumes, (ctx->metaCache.volumeCount + 1) * sizeof(*volumes)))) {
+        ctx->metaCache.volumes = volumes;
+        volumes[ctx->metaCache.volumeCount].volRef = volRef;
+        volumes[ctx->metaCache.volumeCount++].volInfo = *volInfo;
+    }
+    return piErr;
+}
+
+void metaCacheFree(void) {
+    if (ctx->metaCache.hits + ctx->metaCache.misses)
+        logDebug("%s: Remote metadata cache: %ld hits, %ld misses, hit rate %ld%%, saved %ld DLP round trips\n", MYNAME,
+                ctx->metaCache.hits, ctx->metaCache.misses, 100 * ctx->metaCache.hits / (ctx->metaCache.hits + ctx->metaCache.misses), ctx->metaCache.savedCalls);
+    for (unsigned i = 0; ctx->metaCache.slots && i <= ctx->metaCache.mask; i++)
+        free(ctx->metaCache.slots[i].key);
+    free(ctx->metaCache.slots);
+    free(ctx->metaCache.volumes);
+    memset(&ctx->metaCache, 0, sizeof(ctx->metaCache));
 }
 
 time_t getRemoteDate(FileRef fileRef, const int volRef, const char *path, const char prefix[]) {
     time_t date = 0;
-    int close = !fileRef && dlp_VFSFileOpen(sd, volRef, path, vfsModeRead, &fileRef) >= 0;
+    remoteMeta *meta;
+    if (!prefix && (meta = metaGet(volRef, path, META_DATE, fileRef ? 1 : 3)))  return meta->date;
+    int close = !fileRef && dlp_VFSFileOpen(ctx->sd, volRef, path, vfsModeRead, &fileRef) >= 0;
     // 'date modified' seems to be ignored by PalmOS
-    PI_ERR piErr = dlp_VFSFileGetDate(sd, fileRef, useDateModified ? vfsFileDateModified : vfsFileDateCreated, &date);
+    PI_ERR piErr = dlp_VFSFileGetDate(ctx->sd, fileRef, ctx->useDateModified ? vfsFileDateModified : vfsFileDateCreated, &date);
     if (piErr < 0) {
         if (prefix) // for listRemoteFiles()
-            jp_logf(L_DEBUG, "%s WARNING: No 'date %s from   %s\n", prefix, useDateModified ? "modified'":"created' ", path);
-        else  piErrLog(piErr, L_WARN, volRef, path, "      ", useDateModified ?
+            logDebug("%s WARNING: No 'date %s from   %s\n", prefix, ctx->useDateModified ? "modified'":"created' ", path);
+        else  piErrLog(piErr, L_WARN, volRef, path, "      ", ctx->useDateModified ?
                 ": Could not get 'date modified' of file":": Could not get 'date created' of file","");
-    }
-    if (close)  dlp_VFSFileClose(sd, fileRef);
+    } else if (!prefix)
+        metaPut(volRef, path, META_DATE, date, 0, 0);
+    if (close)  dlp_VFSFileClose(ctx->sd, fileRef);
     return date;
 }
 
 void setRemoteDate(FileRef fileRef, const int volRef, const char *path, const time_t date) {
-    int close = !fileRef && dlp_VFSFileOpen(sd, volRef, path, vfsModeReadWrite, &fileRef) >= 0;
+    int close = !fileRef && dlp_VFSFileOpen(ctx->sd, volRef, path, vfsModeReadWrite, &fileRef) >= 0;
     // Set both dates of the file (DateCreated is displayed in Media App on Palm device); must not be before 1980, otherwise PalmOS error.
-    piErrLog(dlp_VFSFileSetDate(sd, fileRef, vfsFileDateCreated, date), L_WARN, volRef, path, "      ", ": Could not set 'date created' of file","");
-    piErrLog(dlp_VFSFileSetDate(sd, fileRef, vfsFileDateModified, date), L_WARN, volRef, path, "      ", ": Could not set 'date modified' of file","");
-    if (close)  dlp_VFSFileClose(sd, fileRef);
+    PI_ERR piErrCreated = piErrLog(dlp_VFSFileSetDate(ctx->sd, fileRef, vfsFileDateCreated, date), L_WARN, volRef, path, "      ", ": Could not set 'date created' of file","");
+    PI_ERR piErrModified = piErrLog(dlp_VFSFileSetDate(ctx->sd, fileRef, vfsFileDateModified, date), L_WARN, volRef, path, "      ", ": Could not set 'date modified' of file","");
+    if (piErrCreated < 0 || piErrModified < 0)
+        metaInvalidate(volRef, path, META_DATE);
+    else
+        metaPut(volRef, path, META_DATE, date, 0, 0);
+    if (close)  dlp_VFSFileClose(ctx->sd, fileRef);
+}
+
+/* Get the attributes of a remote file or dir; negative PI_ERR is returned, if it can't be opened. */
+PI_ERR getRemoteAttributes(const int volRef, const char *path, unsigned long *attr) {
+    remoteMeta *meta;
+    FileRef fileRef;
+    PI_ERR piErr;
+    if ((meta = metaGet(volRef, path, META_ATTR, 3))) {
+        *attr = meta->attr;
+        return 0;
+    }
+    if ((piErr = dlp_VFSFileOpen(ctx->sd, volRef, path, vfsModeRead, &fileRef)) < 0)  return piErr;
+    if (piErrLog(dlp_VFSFileGetAttributes(ctx->sd, fileRef, attr),
+            L_FATAL, volRef, path, "    ", ": Could not get attributes from remote file","") >= 0)
+        metaPut(volRef, path, META_ATTR, 0, *attr, 0);
+    else
+        *attr = 0; // so treat as file
+    dlp_VFSFileClose(ctx->sd, fileRef);
+    return 0;
 }
 
 /*
@@ -244,7 +740,7 @@ void setRemoteDate(FileRef fileRef, const int volRef, const char *path, const ti
  * Caller should allocate and free *path value.
  */
 int createLocalDir(char *path, const char *dir, const int volRef, const char *rmPath) {
-    jp_logf(L_DEBUG, "%s:     createLocalDir(path='%s', dir='%s', volRef=%d, rmPath='%s')\n", MYNAME, path, dir, volRef, rmPath);
+    logDebug("%s:     createLocalDir(path='%s', dir='%s', volRef=%d, rmPath='%s')\n", MYNAME, path, dir, volRef, rmPath);
     char *pathBase = path + strlen(path), *subDir = NULL, parent[NAME_MAX], rmDir[NAME_MAX];
     strcpy(parent, path);
 
@@ -259,7 +755,7 @@ int createLocalDir(char *path, const char *dir, const int volRef, const char *rm
     }
     stpcpy(stpcpy(rmDir, rmPath), pathBase);
     time_t parentDate = strcmp(parent, ".") && strcmp(strrchr(parent, '/'), ADDITIONAL_FILES) ? getLocalDate(parent) : 0; // skip in case
-    jp_logf(L_DEBUG, "%s:     path='%s', subDir='%s', parent='%s', parentDate='%s', rmDir='%s'\n", MYNAME, path, subDir, parent, isoTime(parentDate), rmDir);
+    logDebug("%s:     path='%s', subDir='%s', parent='%s', parentDate='%s', rmDir='%s'\n", MYNAME, path, subDir, parent, isoTime(parentDate), rmDir);
     int result = mkdir(path, 0777);
     if (!result) {
         jp_logf(L_INFO, "%s:     Created local directory '%s'\n", MYNAME, path);
@@ -270,7 +766,7 @@ int createLocalDir(char *path, const char *dir, const int volRef, const char *rm
         return result;
     }
     time_t date = volRef >= 0 && rmDir[0] ? getRemoteDate(0, volRef, rmDir, NULL) : 0;
-    //~ jp_logf(L_DEBUG, "%s:     path='%s', date='%s', volRef=%d, rmDir='%s'\n", MYNAME, path, isoTime(date), volRef, rmDir);
+    //~ logDebug("%s:     path='%s', date='%s', volRef=%d, rmDir='%s'\n", MYNAME, path, isoTime(date), volRef, rmDir);
     if (date)  setLocalDate(path, date); // do always (repair local Media/Internal from /Photos & Videos if initial single sync on #AdditionalFiles)
     if (subDir) {
         return createLocalDir(path, subDir, volRef, rmDir);
@@ -287,7 +783,7 @@ int createLocalDir(char *path, const char *dir, const int volRef, const char *rm
  * Caller should allocate and free *path value.
  */
 PI_ERR createRemoteDir(const int volRef, char *path, const char *dir, const char *lcPath) {
-    jp_logf(L_DEBUG, "%s:     createRemoteDir(volRef=%d, path='%s', dir='%s', lcPath='%s')\n", MYNAME, volRef, path, dir, lcPath);
+    logDebug("%s:     createRemoteDir(volRef=%d, path='%s', dir='%s', lcPath='%s')\n", MYNAME, volRef, path, dir, lcPath);
     char *pathBase = path + strlen(path), *subDir = NULL, lcDir[NAME_MAX];
     if (dir) {
         stpcpy(pathBase, dir);
@@ -295,11 +791,18 @@ PI_ERR createRemoteDir(const int volRef, char *path, const char *dir, const char
             *(strchr(pathBase + 1, '/')) = '\0';
     }
     stpcpy(stpcpy(lcDir, lcPath), pathBase);
-    PI_ERR piErr = dlp_VFSDirCreate(sd, volRef, path);
-    int piOSErr = piErr == PI_ERR_DLP_PALMOS ? pi_palmos_error(sd) : 0;
+    PI_ERR piErr = PI_ERR_DLP_PALMOS;
+    int piOSErr = 10758; // File already existing.
+    if (!metaGet(volRef, path, META_EXISTS, 1)) {
+        piErr = dlp_VFSDirCreate(ctx->sd, volRef, path);
+        piOSErr = piErr == PI_ERR_DLP_PALMOS ? pi_palmos_error(ctx->sd) : 0;
+        if (piErr >= 0 || piOSErr == 10758)
+            metaPut(volRef, path, META_EXISTS | META_ATTR, 0, vfsFileAttrDirectory, 0);
+    }
     if (piErr >= 0) {
         jp_logf(L_INFO, "%s:     Created remote directory '%s' on volume %d\n", MYNAME, path, volRef);
-        importantWarning = 1;
+        metaInvalidate(volRef, path, META_DATE);
+        ctx->importantWarning++;
         time_t date = getLocalDate(lcDir);
         if (date)  setRemoteDate(0, volRef, path, date); // set remote dir date, if really created
     } else if (piOSErr != 10758) { // File not already existing.
@@ -315,131 +818,702 @@ PI_ERR createRemoteDir(const int volRef, char *path, const char *dir, const char
 
 /*
  * Return directory name on the PC, where the albums should be stored. Returned string is of the form
- * "$JPILOT_HOME/.jpilot/$PCDIR/VolumeRoot/". Directories in the path are created as needed.
+ * "$JPILOT_HOME/.jpilot/$PCDIR/VolumeRoot/". Directories in the path are created as needed, but not in a dry run.
  * Null is returned if out of memory.
  * Caller should free return value.
  */
 static char *localRoot(const unsigned volRef) {
-    static char path[NAME_MAX];
+    char *path = ctx->localRoot;
+    const char *dir = NULL;
     VFSInfo volInfo;
     PI_ERR piErr;
 
-    if (createLocalDir(strcpy(path, mediaHome), NULL, -1, ""))  return NULL;
+    strcpy(path, ctx->mediaHome);
+    if (!ctx->dryRun && createLocalDir(path, NULL, -1, ""))  return NULL;
     // Get indicator of which card.
-    if ((piErr = dlp_VFSVolumeInfo(sd, volRef, &volInfo)) < 0) {
+    if ((piErr = getVolumeInfo(volRef, &volInfo)) < 0) {
         jp_logf(L_FATAL, "%s:     %s Could not get info from volume %d\n", MYNAME, errString(1, piErr, L_FATAL, ""), volRef);
         return NULL;
     }
-    if (volInfo.mediaType == pi_mktag('T', 'F', 'F', 'S')) {
-        if (createLocalDir(path, LOCALDIRS[0], -1, ""))  return NULL;
-    } else if (volInfo.mediaType == pi_mktag('s', 'd', 'i', 'g')) {
-        if (createLocalDir(path, LOCALDIRS[1], -1, ""))  return NULL;
-    } else {
+    if (volInfo.mediaType == pi_mktag('T', 'F', 'F', 'S'))
+        dir = LOCALDIRS[0];
+    else if (volInfo.mediaType == pi_mktag('s', 'd', 'i', 'g'))
+        dir = LOCALDIRS[1];
+    else
         sprintf(path+strlen(path), "%s%d", LOCALDIRS[2], volInfo.slotRefNum);
-        if (createLocalDir(path, NULL, -1, ""))  return NULL;
+    if (ctx->dryRun) { // only resolve the path, as a dry run doesn't change anything
+        if (dir)  strcat(path, dir);
+    } else if (createLocalDir(path, dir, -1, ""))
+        return NULL;
+    return path; // must not be free'd by caller as it's an array of the context
+}
+
+/*
+ * Matchers compiled once per sync from the prefs fileTypes and excludeDirs, so matching a name costs O(1),
+ * resp. the depth of the path, instead of a walk over the parsed pref lists per file and dir.
+ */
+typedef struct typeSlot {const char *ext; int rank; int backupOnly;} typeSlot; // ext NULL if slot empty
+typedef struct typeMatcher typeMatcher;
+
+static unsigned hashCaseName(const char *name) {
+    unsigned hash = 2166136261u; // FNV-1a over the lower case name
+    while (*name)  hash = (hash ^ (unsigned char)tolower((unsigned char)*name++)) * 16777619u;
+    return hash;
+}
+
+/* Builds the table of extensions from the fileTypeList, where the first of duplicate types wins as before. */
+int typeMatcherBuild(typeMatcher *matcher, const fullPath *list) {
+    unsigned size = 16, count = 0, rank = 0;
+    for (const fullPath *item = list; item; item = item->next)  count++;
+    while (size < 2 * count)  size *= 2; // keep load factor <= 0.5
+    if (!(matcher->slots = calloc(size, sizeof(*matcher->slots))))  return EXIT_FAILURE;
+    matcher->mask = size - 1;
+    for (const fullPath *item = list; item; item = item->next, rank++) {
+        const char *ext = item->name + (*item->name == '-');
+        unsigned slot = hashCaseName(ext) & matcher->mask;
+        for (; matcher->slots[slot].ext && strcasecmp(ext, matcher->slots[slot].ext); slot = (slot + 1) & matcher->mask);
+        if (!matcher->slots[slot].ext)
+            matcher->slots[slot] = (typeSlot){ext, rank, *item->name == '-'};
+    }
+    return EXIT_SUCCESS;
+}
+
+static const typeSlot *typeMatcherFind(const char *fname) {
+    const typeMatcher *matcher = &ctx->fileTypeMatcher;
+    const char *ext = strrchr(fname, '.');
+    if (!ext || !matcher->slots)  return NULL;
+    for (unsigned slot = hashCaseName(++ext) & matcher->mask; matcher->slots[slot].ext; slot = (slot + 1) & matcher->mask) {
+        if (!strcasecmp(ext, matcher->slots[slot].ext))  return matcher->slots + slot;
     }
-    return path; // must not be free'd by caller as it's a static array
+    return NULL;
 }
 
+/*
+ * Trie over the '/' separated components of the excludeDirs, stored flat in one array, where each node
+ * links to its first child and next sibling. A component may be a glob pattern, as of fnmatch(3).
+ * As a rule excludes the whole subtree below its dir, matching stops at the first node with a rule,
+ * so a dir is pruned before it is opened or enumerated on the Palm.
+ */
+typedef struct trieNode {
+    const char *name; // component, points into pathTrie.names
+    int child, sibling; // indices into pathTrie.nodes, 0 = none, as node 0 is the root
+    int glob; // name contains glob characters
+    int volRef; // of the rule ending here: -1 = all volumes, -2 = no rule, -3 = rules for several volumes
+    int rule; // index of the rules in pathTrie.rules, if volRef == -3
+} trieNode;
+typedef struct pathTrie pathTrie;
+
+void pathTrieFree(pathTrie *trie) {
+    free(trie->nodes);
+    free(trie->names);
+    free(trie->rules);
+    memset(trie, 0, sizeof(*trie));
+}
+
+static int trieChild(pathTrie *trie, const int parent, const char *name) {
+    for (int child = trie->nodes[parent].child; child; child = trie->nodes[child].sibling) {
+        if (!strcmp(trie->nodes[child].name, name))  return child;
+    }
+    if (trie->count == trie->allocated) {
+        int allocated = trie->allocated * 2;
+        trieNode *nodes = realloc(trie->nodes, allocated * sizeof(*nodes));
+        if (!nodes)  return -1;
+        trie->nodes = nodes;
+        trie->allocated = allocated;
+    }
+    trie->nodes[trie->count] = (trieNode){name, 0, trie->nodes[parent].child, strpbrk(name, "*?[") != NULL, -2, 0};
+    return trie->nodes[parent].child = trie->count++;
+}
+
+/* Adds volRef to the rules of node, keeping the rules of several volumes as pairs of volRef and next index. */
+static int trieAddRule(pathTrie *trie, trieNode *node, const int volRef) {
+    if (node->volRef == -1 || node->volRef == volRef)  return EXIT_SUCCESS;
+    if (node->volRef == -2 || volRef == -1) {
+        node->volRef = volRef;
+        return EXIT_SUCCESS;
+    }
+    int *rules = realloc(trie->rules, (trie->ruleCount + 4) * sizeof(*rules));
+    if (!rules)  return EXIT_FAILURE;
+    trie->rules = rules;
+    if (node->volRef >= 0) { // convert the single rule into a chain
+        rules[trie->ruleCount] = node->volRef;
+        rules[trie->ruleCount + 1] = -1;
+        node->rule = trie->ruleCount;
+        node->volRef = -3;
+        trie->ruleCount += 2;
+    }
+    rules[trie->ruleCount] = volRef;
+    rules[trie->ruleCount + 1] = node->rule;
+    node->rule = trie->ruleCount;
+    trie->ruleCount += 2;
+    return EXIT_SUCCESS;
+}
+
+int pathTrieBuild(pathTrie *trie, const fullPath *list) {
+    size_t namesSize = 0;
+    for (const fullPath *item = list; item; item = item->next)  namesSize += strlen(item->name) + 1;
+    memset(trie, 0, sizeof(*trie));
+    if (!(trie->names = malloc(namesSize + 1)) || !(trie->nodes = malloc((trie->allocated = 16) * sizeof(*trie->nodes)))) {
+        pathTrieFree(trie);
+        return EXIT_FAILURE;
+    }
+    trie->nodes[trie->count++] = (trieNode){"", 0, 0, 0, -2, 0};
+    char *names = trie->names;
+    for (const fullPath *item = list; item; item = item->next) {
+        int node = 0;
+        char *component = strcpy(names, item->name);
+        names += strlen(names) + 1;
+        for (char *next; component; component = next) {
+            if ((next = strchr(component, '/')))  *next++ = '\0';
+            if (*component && (node = trieChild(trie, node, component)) < 0)
+                break;
+        }
+        if (node < 0 || trieAddRule(trie, trie->nodes + node, item->volRef)) {
+            pathTrieFree(trie);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static int trieRuleMatches(const pathTrie *trie, const trieNode *node, const int volRef) {
+    if (node->volRef != -3)  return node->volRef == -1 || node->volRef == volRef;
+    for (int rule = node->rule; rule >= 0; rule = trie->rules[rule + 1]) {
+        if (trie->rules[rule] == volRef)  return 1;
+    }
+    return 0;
+}
+
+/* Returns 1, if path is below a rule of the trie for volRef. Globs may match several siblings, so they are backtracked. */
+static int trieMatches(const pathTrie *trie, const int node, const int volRef, const char *path) {
+    char component[NAME_MAX];
+    size_t length;
+
+    if (trieRuleMatches(trie, trie->nodes + node, volRef))  return 1;
+    while (*path == '/')  path++;
+    if (!*path || (length = strcspn(path, "/")) >= sizeof(component))  return 0;
+    memcpy(component, path, length);
+    component[length] = '\0';
+    for (int child = trie->nodes[node].child; child; child = trie->nodes[child].sibling) {
+        const trieNode *item = trie->nodes + child;
+        if ((item->glob ? !fnmatch(item->name, component, 0) : !strcmp(item->name, component))
+                && trieMatches(trie, child, volRef, path + length))
+            return 1;
+    }
+    return 0;
+}
+
+/* Returns 0, if dname is excluded by pref excludeDirs, otherwise 1. */
 int cmpExcludeDirList(const int volRef, const char *dname) {
-    int result = 1;
-    for (fullPath *item = excludeDirList; dname && item; item = item->next) {
-        if ((item->volRef < 0 || volRef == item->volRef) && !(result = strcmp(dname, item->name)))  break;
+    return !(dname && ctx->excludeTrie.nodes && trieMatches(&ctx->excludeTrie, 0, volRef, dname));
+}
+
+int casecmpFileTypeList(const char *fname) {
+    const typeSlot *type = typeMatcherFind(fname);
+    return type ? !type->backupOnly : -1; // 1 = backup & restore, 0 = only backup, -1 = no match, no sync
+}
+
+/* Returns the position of the type of fname in pref fileTypes, or -1, if not synced. */
+int fileTypeRank(const char *fname) {
+    const typeSlot *type = typeMatcherFind(fname);
+    return type ? type->rank : -1;
+}
+
+/*
+ * Growable heap-backed listing of a remote dir, see media.h. The names are stored in chunks, which never move,
+ * so a listing only takes the space of the real names instead of the fixed 256 bytes of VFSDirInfo.
+ */
+struct nameChunk {struct nameChunk *next; size_t used; char data[NAME_CHUNK];};
+
+int dirListingAdd(dirListing *list, const unsigned long attr, const char *name, const size_t nameLen) {
+    size_t len = nameLen + 1;
+    if (list->count >= list->allocated) {
+        int allocated = list->allocated ? list->allocated * 2 : DIR_BATCH;
+        dirItem *items = realloc(list->items, allocated * sizeof(*items));
+        if (!items) {
+            jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+            return EXIT_FAILURE;
+        }
+        list->items = items;
+        list->allocated = allocated;
     }
-    return result;
+    if (!list->names || list->names->used + len > NAME_CHUNK) {
+        nameChunk *chunk;
+        if (!(chunk = mallocLog(sizeof(*chunk))))  return EXIT_FAILURE;
+        chunk->next = list->names;
+        chunk->used = 0;
+        list->names = chunk;
+    }
+    dirItem *item = list->items + list->count++;
+    item->attr = attr;
+    item->size = -1;
+    item->date = 0;
+    item->name = memcpy(list->names->data + list->names->used, name, nameLen);
+    item->name[nameLen] = '\0';
+    list->names->used += len;
+    return EXIT_SUCCESS;
 }
 
-int enumerateOpenDir(const int volRef, const FileRef dirRef, const char *rmDir, VFSDirInfo dirInfos[]) {
-    int dirItems_init = MIN_DIR_ITEMS, dirItems;
-    PI_ERR piErr;
+int dirListingAppend(dirListing *list, const VFSDirInfo *info) {
+    return dirListingAdd(list, info->attr, info->name, strnlen(info->name, sizeof(info->name) - 1));
+}
+
+void dirListingFree(dirListing *list) {
+    for (nameChunk *chunk; (chunk = list->names);) {
+        list->names = chunk->next;
+        free(chunk);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+/*
+ * Index the regular files and dirs of local dir path into *list, which must be empty, the dirs with vfsFileAttrDirectory
+ * as in the remote listings, so albums are read once and no absolute path is rebuilt and stat'ed per entry.
+ * The type is taken from d_type, only for symlinks and on file systems without d_type from fstatat() relative to the dir.
+ * Files of the synced types additionally get their size and date for the diff of the snapshots.
+ * Returns the number of entries, of which the status could not be read, or -1, if the dir could not be read.
+ */
+int indexLocalDir(const char *path, dirListing *list) {
+    int fd, errors = 0;
+    DIR *dirP;
+
+    if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || !(dirP = fdopendir(fd))) {
+        jp_logf(L_FATAL, "%s:    ERROR: Could not open dir '%s'\n", MYNAME, path);
+        if (fd >= 0)  close(fd);
+        return -1;
+    }
+    for (struct dirent *entry; (entry = readdir(dirP));) {
+        unsigned char type = entry->d_type;
+        struct stat fileStat;
+        int statted = 0;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))  continue;
+        if ((type == DT_UNKNOWN || type == DT_LNK || (type == DT_REG && casecmpFileTypeList(entry->d_name) >= 0))) {
+            if (fstatat(fd, entry->d_name, &fileStat, 0)) { // follows symlinks
+                jp_logf(L_FATAL, "%s:      ERROR %d: Could not read status of %s/%s; No sync possible!\n", MYNAME, errno, path, entry->d_name);
+                errors++;
+                continue;
+            }
+            type = S_ISREG(fileStat.st_mode) ? DT_REG : S_ISDIR(fileStat.st_mode) ? DT_DIR : DT_UNKNOWN;
+            statted = 1;
+        }
+        if ((type == DT_REG || type == DT_DIR) && dirListingAdd(list, type == DT_DIR ? vfsFileAttrDirectory : 0,
+                entry->d_name, strlen(entry->d_name))) {
+            errors = -1;
+            break;
+        }
+        if (statted && type == DT_REG) {
+            list->items[list->count - 1].size = fileStat.st_size;
+            list->items[list->count - 1].date = fileStat.st_mtime;
+        }
+    }
+    closedir(dirP); // also closes fd
+    return errors;
+}
+
+/*
+ * Remember per device and volume, whether the dir iterator can be resumed, or enumeration must restart from
+ * vfsIteratorStart, as some volumes return broken iterator values (i.e. 1888 on SDCard, see enumerateOpenDir()).
+ * The strategies are kept in file mediaHome/ITERATORS_FILE as lines of "userID volRef strategy".
+ */
+enum iteratorStrategy {ITR_UNKNOWN, ITR_RESUME, ITR_RESTART};
+static const char *ITR_STRATEGIES[] = {"unknown", "resume", "restart"};
+
+static volIterator *findIteratorStrategy(const int volRef) {
+    for (int i = 0; i < ctx->volIterators.count; i++) {
+        if (ctx->volIterators.items[i].userID == ctx->userID && ctx->volIterators.items[i].volRef == volRef)
+            return ctx->volIterators.items + i;
+    }
+    return NULL;
+}
+
+int getIteratorStrategy(const int volRef) {
+    volIterator *item = findIteratorStrategy(volRef);
+    return item ? item->strategy : ITR_UNKNOWN;
+}
+
+void setIteratorStrategy(const int volRef, const int strategy) {
+    volIterator *item = findIteratorStrategy(volRef);
+    if (!item) {
+        volIterator *items = realloc(ctx->volIterators.items, (ctx->volIterators.count + 1) * sizeof(*items));
+        if (!items)  return;
+        item = (ctx->volIterators.items = items) + ctx->volIterators.count++;
+        item->userID = ctx->userID;
+        item->volRef = volRef;
+    } else if (item->strategy == strategy)
+        return;
+    item->strategy = strategy;
+    ctx->volIterators.changed = 1;
+    logDebug("%s: Dir iterator strategy on volume %d of device %lu: %s\n", MYNAME, volRef, ctx->userID, ITR_STRATEGIES[strategy]);
+}
+
+void loadIteratorStrategies(void) {
+    char path[NAME_MAX + sizeof(ITERATORS_FILE)];
+    FILE *fileP;
+    volIterator item;
+
+    if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), ITERATORS_FILE), "r")))  return;
+    while (fscanf(fileP, "%lu %d %d", &item.userID, &item.volRef, &item.strategy) == 3) {
+        volIterator *items;
+        if (item.strategy < ITR_UNKNOWN || item.strategy > ITR_RESTART
+                || !(items = realloc(ctx->volIterators.items, (ctx->volIterators.count + 1) * sizeof(*items))))
+            continue;
+        (ctx->volIterators.items = items)[ctx->volIterators.count++] = item;
+    }
+    fclose(fileP);
+}
+
+void saveIteratorStrategies(void) {
+    char path[NAME_MAX + sizeof(ITERATORS_FILE)];
+    FILE *fileP;
+
+    if (!ctx->volIterators.changed)  return;
+    if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), ITERATORS_FILE), "w"))) {
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing dir iterator strategies\n", MYNAME, path);
+        return;
+    }
+    for (int i = 0; i < ctx->volIterators.count; i++)
+        fprintf(fileP, "%lu %d %d\n", ctx->volIterators.items[i].userID, ctx->volIterators.items[i].volRef, ctx->volIterators.items[i].strategy);
+    fclose(fileP);
+}
+
+void freeIteratorStrategies(void) {
+    free(ctx->volIterators.items);
+    memset(&ctx->volIterators, 0, sizeof(ctx->volIterators));
+}
+
+/*
+ * Tune the size of the chunks per device, volume and direction, in which files are read from or written to the Palm.
+ * The throughput of full chunks is measured while copying, and the size is hill climbed over the powers of 2 between
+ * 1 << CHUNK_SHIFT and CHUNK_MAX towards the best rate, so it converges, even if larger chunks become slower.
+ * The learned rates are kept in file mediaHome/CHUNKS_FILE as lines of "userID volRef direction rate...".
+ */
+enum chunkDirection {CHUNK_READ, CHUNK_WRITE};
+static const char *CHUNK_DIRECTIONS[] = {"reading", "writing"};
+
+static int bestChunkSize(const chunkTuner *tuner) {
+    int best = CHUNK_DEFAULT;
+    for (int i = 0; i < CHUNK_SIZES; i++) {
+        if (tuner->rates[i] > tuner->rates[best])  best = i;
+    }
+    return best;
+}
+
+static chunkTuner *findChunkTuner(const int volRef, const int direction) {
+    for (int i = 0; i < ctx->chunkTuners.count; i++) {
+        chunkTuner *tuner = ctx->chunkTuners.items + i;
+        if (tuner->userID == ctx->userID && tuner->volRef == volRef && tuner->direction == direction)
+            return tuner;
+    }
+    chunkTuner *items = realloc(ctx->chunkTuners.items, (ctx->chunkTuners.count + 1) * sizeof(*items));
+    if (!items)  return NULL;
+    chunkTuner *tuner = (ctx->chunkTuners.items = items) + ctx->chunkTuners.count++;
+    memset(tuner, 0, sizeof(*tuner));
+    tuner->userID = ctx->userID;
+    tuner->volRef = volRef;
+    tuner->direction = direction;
+    tuner->current = CHUNK_DEFAULT;
+    return tuner;
+}
+
+/* Select the tuners for copying files from or to volume volRef. */
+void selectChunkTuners(const int volRef) {
+    ctx->readTuner = ctx->writeTuner = NULL;
+    if (ctx->chunkSize || !findChunkTuner(volRef, CHUNK_WRITE))  return; // first create, as realloc() may move the items
+    ctx->readTuner = findChunkTuner(volRef, CHUNK_READ);
+    ctx->writeTuner = findChunkTuner(volRef, CHUNK_WRITE);
+}
+
+/* Returns the size of the next chunk to transfer by tuner, or the pinned size from the prefs. */
+int chunkSizeOf(const chunkTuner *tuner) {
+    if (ctx->chunkSize)  return MIN(MAX(ctx->chunkSize, 1 << CHUNK_SHIFT), CHUNK_MAX);
+    return 1 << (CHUNK_SHIFT + (tuner ? tuner->current : CHUNK_DEFAULT));
+}
+
+/* Account a transfer of bytes, which took secs, and move on to the next size to probe, if enough was measured. */
+void tuneChunkSize(chunkTuner *tuner, const int bytes, const double secs) {
+    if (!tuner || bytes != chunkSizeOf(tuner))  return; // only full chunks are representative
+    tuner->bytes += bytes;
+    tuner->secs += secs;
+    if (tuner->bytes < CHUNK_PROBE || tuner->secs <= 0)  return;
+    double rate = tuner->bytes / tuner->secs, *known = tuner->rates + tuner->current;
+    *known = *known ? (*known * 3 + rate) / 4 : rate; // smooth out hickups of the connection
+    tuner->bytes = 0;
+    tuner->secs = 0;
+    ctx->chunkTuners.changed = 1;
+    // Probe the unmeasured neighbours of the best size, otherwise stay with the best.
+    int best = bestChunkSize(tuner), next = best;
+    if (best > 0 && !tuner->rates[best - 1])
+        next = best - 1;
+    else if (best < CHUNK_SIZES - 1 && !tuner->rates[best + 1])
+        next = best + 1;
+    if (next != tuner->current)
+        logDebug("%s:       Chunk size for %s on volume %d: %d bytes at %.0f bytes/s, next probe %d bytes\n", MYNAME,
+                CHUNK_DIRECTIONS[tuner->direction], tuner->volRef, chunkSizeOf(tuner), *known, 1 << (CHUNK_SHIFT + next));
+    tuner->current = next;
+}
+
+void loadChunkTuners(void) {
+    char path[NAME_MAX + sizeof(CHUNKS_FILE)];
+    FILE *fileP;
+    chunkTuner item = {0};
+
+    if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), CHUNKS_FILE), "r")))  return;
+    while (fscanf(fileP, "%lu %d %d", &item.userID, &item.volRef, &item.direction) == 3) {
+        chunkTuner *items;
+        int i = 0;
+        while (i < CHUNK_SIZES && fscanf(fileP, "%lf", item.rates + i) == 1 && item.rates[i] >= 0)  i++;
+        if (i < CHUNK_SIZES || item.direction < CHUNK_READ || item.direction > CHUNK_WRITE
+                || !(items = realloc(ctx->chunkTuners.items, (ctx->chunkTuners.count + 1) * sizeof(*items))))
+            continue;
+        item.current = bestChunkSize(&item);
+        (ctx->chunkTuners.items = items)[ctx->chunkTuners.count++] = item;
+    }
+    fclose(fileP);
+}
+
+void saveChunkTuners(void) {
+    char path[NAME_MAX + sizeof(CHUNKS_FILE)];
+    FILE *fileP;
 
+    if (!ctx->chunkTuners.changed)  return;
+    if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), CHUNKS_FILE), "w"))) {
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing chunk sizes\n", MYNAME, path);
+        return;
+    }
+    for (int i = 0; i < ctx->chunkTuners.count; i++) {
+        chunkTuner *tuner = ctx->chunkTuners.items + i;
+        if (!tuner->rates[bestChunkSize(tuner)])  continue; // nothing learned yet
+        fprintf(fileP, "%lu %d %d", tuner->userID, tuner->volRef, tuner->direction);
+        for (int j = 0; j < CHUNK_SIZES; j++)
+            fprintf(fileP, " %.0f", tuner->rates[j]);
+        fprintf(fileP, "\n");
+        logDebug("%s: Chunk size for %s on volume %d of device %lu: %d bytes\n", MYNAME,
+                CHUNK_DIRECTIONS[tuner->direction], tuner->volRef, tuner->userID, 1 << (CHUNK_SHIFT + bestChunkSize(tuner)));
+    }
+    fclose(fileP);
+}
+
+void freeChunkTuners(void) {
+    free(ctx->chunkTuners.items);
+    memset(&ctx->chunkTuners, 0, sizeof(ctx->chunkTuners));
+    ctx->readTuner = ctx->writeTuner = NULL;
+}
+
+/*
+ * Enumerate all items of an open remote dir into *list, which must be empty.
+ * The items are streamed batch by batch, resuming from the returned iterator, so the transfer buffer stays bounded.
+ * If the iterator turns out to be broken on this volume, which is remembered, re-enumerate from start with a growing batch
+ * up to DIR_BATCH_MAX items, and from there try to resume again, so memory and round trips stay bounded.
+ * Returns the number of items, or negative PI_ERR.
+ */
+int enumerateOpenDir(const int volRef, const FileRef dirRef, const char *rmDir, dirListing *list) {
+    int batchSize = DIR_BATCH, dirItems, strategy = getIteratorStrategy(volRef);
+    VFSDirInfo *batch;
+    PI_ERR piErr = 0;
+
+    if (!(batch = mallocLog(batchSize * sizeof(*batch))))  return -1;
+    if (strategy == ITR_RESTART) {
+        batchSize /= 2; // will be doubled again in fallback loop
+        goto Fallback;
+    }
     // Iterate over all the files in the remote dir.
     //~ enum dlpVFSFileIteratorConstants itr = vfsIteratorStart; // doesn't work because of type mismatch bug <https://github.com/juddmon/jpilot/issues/39>
     //~ while (itr != (unsigned long)vfsIteratorStop) { // doesn't work because of bug <https://github.com/juddmon/jpilot/issues/39>
     //~ while (itr != (unsigned)vfsIteratorStop) { // doesn't work because of bug <https://github.com/juddmon/jpilot/issues/41>
-    unsigned long itr = (unsigned long)vfsIteratorStart;
-    int loops = 16; // for debugging
-    for (; (dirItems = dirItems_init) <= MAX_DIR_ITEMS && dirItems > 0; dirItems_init *= 2) { // WORKAROUND
-        if (--loops < 0)  break; // for debugging
-        //~ jp_logf(L_DEBUG, "%s:      Enumerate remote dir '%s': dirRef=%8lx, itr=%4lx, dirItems=%d\n", MYNAME, rmDir, dirRef, itr, dirItems);
-        if ((piErr = piErrLog(dlp_VFSDirEntryEnumerate(sd, dirRef, &itr, &dirItems, dirInfos),
-                L_FATAL, volRef, rmDir, "     ", ": Could not enumerate dir","")) < 0) {
+    for (unsigned long itr = (unsigned long)vfsIteratorStart, lastItr; (enum dlpVFSFileIteratorConstants)itr != vfsIteratorStop;) {
+        lastItr = itr;
+        dirItems = batchSize;
+        //~ logDebug("%s:      Enumerate remote dir '%s': dirRef=%8lx, itr=%4lx, dirItems=%d\n", MYNAME, rmDir, dirRef, itr, dirItems);
+        if ((piErr = dlp_VFSDirEntryEnumerate(ctx->sd, dirRef, &itr, &dirItems, batch)) < 0 && !list->count) {
             // Crashes on empty directory (see: <https://github.com/desrod/pilot-link/issues/11>):
-            // Further research is neccessary (see: <https://github.com/juddmon/jpilot/issues/41>):
-            // - Why in case of i.e. setting dirItems=4, itr != 0, even if there are more than 4 files?
-            // - Why then on SDCard itr == 1888 in the first loop, so out of allowed range?
-            //~ jp_logf(L_DEBUG, "%s:      Enumerate ERROR %4d: dirRef=%8lx, itr=%4lx, dirItems=%d\n", MYNAME, piErr, dirRef, itr, dirItems);
-            return piErr;
-        }
-        //~ jp_logf(L_DEBUG, "%s:      Enumerate OK: piErr=%4d, dirRef=%8lx, itr=%4lx, dirItems=%d\n", MYNAME, piErr, dirRef, itr, dirItems);
-        //~ for (int i = dirItems_init==MIN_DIR_ITEMS ? 0 : dirItems_init/2; i < dirItems; i++) {
-            //~ jp_logf(L_DEBUG, "%s:       dirItem %3d: '%s' attributes %x\n", MYNAME, i, dirInfos[i].name, dirInfos[i].attr);
-        //~ }
-        if (dirItems < dirItems_init)
-            break;
-        itr = (unsigned long)vfsIteratorStart; // workaround, reset itr for next loop, if it wrongly was -1 or 1888
+            piErrLog(piErr, L_FATAL, volRef, rmDir, "     ", ": Could not enumerate dir","");
+            goto Exit;
+        }
+        // Further research is neccessary (see: <https://github.com/juddmon/jpilot/issues/41>):
+        // - Why in case of i.e. setting dirItems=4, itr != 0, even if there are more than 4 files?
+        // - Why then on SDCard itr == 1888 in the first loop, so out of allowed range?
+        // So detect a broken iterator by error, no progress or restarting from the first item.
+        if (piErr < 0 || (!dirItems && (enum dlpVFSFileIteratorConstants)itr != vfsIteratorStop) || itr == lastItr
+                || (dirItems && list->count && !strcmp(batch[0].name, list->items[0].name))) {
+            logDebug("%s:      Broken iterator on '%s': piErr=%d, itr=%4lx, lastItr=%4lx, dirItems=%d\n", MYNAME, rmDir, piErr, itr, lastItr, dirItems);
+            setIteratorStrategy(volRef, ITR_RESTART);
+            goto Fallback;
+        }
+        if (list->count)  strategy = ITR_RESUME; // resuming proved to work
+        for (int i = 0; i < dirItems; i++) {
+            if (dirListingAppend(list, batch + i)) {
+                piErr = -1;
+                goto Exit;
+            }
+        }
     }
-    if (dirItems >= MAX_DIR_ITEMS)
-        jp_logf(L_FATAL, "%s:      Enumerate OVERFLOW: There seem to be more than %d dir items in '%s'!\n", MYNAME, MAX_DIR_ITEMS, rmDir);
-    return dirItems;
+    if (strategy == ITR_RESUME)  setIteratorStrategy(volRef, ITR_RESUME);
+    goto Exit;
+
+Fallback: // WORKAROUND: Reset itr and re-enumerate from start with doubled batchSize up to DIR_BATCH_MAX, appending only the new items.
+    for (unsigned long itr = (unsigned long)vfsIteratorStart, lastItr; ; ) {
+        int resume = batchSize >= DIR_BATCH_MAX; // at the limit, continue from the returned iterator, if it works
+        if (resume && (enum dlpVFSFileIteratorConstants)itr == vfsIteratorStop)
+            goto Exit;
+        if (!resume) {
+            VFSDirInfo *grown = realloc(batch, MIN(batchSize * 2, DIR_BATCH_MAX) * sizeof(*batch));
+            if (!grown) {
+                jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+                piErr = -1;
+                goto Exit;
+            }
+            batch = grown;
+            batchSize = MIN(batchSize * 2, DIR_BATCH_MAX);
+            itr = (unsigned long)vfsIteratorStart;
+        }
+        lastItr = itr;
+        dirItems = batchSize;
+        if ((piErr = piErrLog(dlp_VFSDirEntryEnumerate(ctx->sd, dirRef, &itr, &dirItems, batch),
+                L_FATAL, volRef, rmDir, "     ", ": Could not enumerate dir","")) < 0)
+            goto Exit;
+        if (resume && ((!dirItems && (enum dlpVFSFileIteratorConstants)itr != vfsIteratorStop) || itr == lastItr
+                || (dirItems && !strcmp(batch[0].name, list->items[0].name)))) {
+            jp_logf(L_FATAL, "%s:      ERROR: Could not enumerate more than %d items of '%s', as the dir iterator is broken.\n", MYNAME, list->count, rmDir);
+            piErr = -1;
+            goto Exit;
+        }
+        for (int i = resume ? 0 : list->count; i < dirItems; i++) {
+            if (dirListingAppend(list, batch + i)) {
+                piErr = -1;
+                goto Exit;
+            }
+        }
+        if (!resume && dirItems < batchSize)
+            goto Exit;
+    }
+Exit:
+    free(batch);
+    TRACE(TRACE_ENUMERATE, volRef, piErr < 0 ? piErr : list->count, 0, rmDir);
+    if (piErr < 0)  return piErr;
+    for (int i = 0; i < list->count; i++) { // remember the existing sub dirs
+        if (list->items[i].attr & vfsFileAttrDirectory) {
+            char child[strlen(rmDir) + strlen(list->items[i].name) + 2];
+            stpcpy(stpcpy(stpcpy(child, strcmp(rmDir, "/") ? rmDir : ""), "/"), list->items[i].name);
+            metaPut(volRef, child, META_ATTR, 0, list->items[i].attr, 0);
+        }
+    }
+    return list->count;
 }
 
-int enumerateDir(const int volRef, const char *rmDir, VFSDirInfo dirInfos[]) { // ToDo: maybe combine with upper function
+int enumerateDir(const int volRef, const char *rmDir, dirListing *list) { // ToDo: maybe combine with upper function
     FileRef dirRef;
-    PI_ERR piErr = dlp_VFSFileOpen(sd, volRef, rmDir, vfsModeRead, &dirRef);
+    PI_ERR piErr = dlp_VFSFileOpen(ctx->sd, volRef, rmDir, vfsModeRead, &dirRef);
     if (piErrLog(piErr, L_FATAL, volRef, rmDir, "      ", ": Could not open dir","") < 0)  return piErr;
-    int dirItems = enumerateOpenDir(volRef, dirRef, rmDir, dirInfos);
-    dlp_VFSFileClose(sd, dirRef);
+    int dirItems = enumerateOpenDir(volRef, dirRef, rmDir, list);
+    dlp_VFSFileClose(ctx->sd, dirRef);
     return dirItems;
 }
 
-/* List remote files and directories recursivly up to given depth. */
-PI_ERR listRemoteFiles(const int volRef, const char *rmDir, const int depth) {
-    FileRef fileRef;
-    VFSDirInfo dirInfos[MAX_DIR_ITEMS];
-    char prefix[] = MYNAME":                 ";
-
-    prefix[MIN(sizeof(prefix) - 1, strlen(MYNAME) + 1 + depth)] = '\0';
-    if (!cmpExcludeDirList(volRef, rmDir))  return -1; // avoid bug <https://github.com/desrod/pilot-link/issues/11>
-    int dirItems = enumerateDir(volRef, rmDir, dirInfos);
-    jp_logf(L_DEBUG, "%s%d remote files in '%s' on Volume %d ...\n", prefix, dirItems, rmDir, volRef);
-    for (int i = 0; i < dirItems; i++) {
-        char child[NAME_MAX];
-        int filesize = 0;
-        time_t date = 0;
-
-        char *temp = stpcpy(child, strcmp(rmDir, "/") ? rmDir : "");
-        temp = stpncpy(temp, "/", NAME_MAX-1-strlen(child));
-        stpncpy(temp, dirInfos[i].name, NAME_MAX-1-strlen(child));
-        //~ strncat(strcmp(rmDir, "/") ? strncat(strcat(child, rmDir), "/", NAME_MAX-1) : child, dirInfos[i].name, NAME_MAX-1); // for paths without '/' at start
-        if (dlp_VFSFileOpen(sd, volRef, child, vfsModeRead, &fileRef) < 0) {
-            jp_logf(L_DEBUG, "%s WARNING: Cannot get size/date from %s\n", prefix, dirInfos[i].name);
-        } else {
-            if (!(dirInfos[i].attr & vfsFileAttrDirectory) && (dlp_VFSFileSize(sd, fileRef, &filesize) < 0))
-                jp_logf(L_DEBUG, "%s WARNING: Could not get size   of   %s\n", prefix, dirInfos[i].name);
-            date = getRemoteDate(fileRef, 0, dirInfos[i].name, prefix);
-            dlp_VFSFileClose(sd, fileRef);
-        }
-        //~ jp_logf(L_DEBUG, "%s 0x%02x%10d %s %s %s\n", prefix, dirInfos[i].attr, filesize, isoTime(&dateCre), isoTime(&dateMod), dirInfos[i].name);
-        jp_logf(L_DEBUG, "%s 0x%02x%10d %s %s\n", prefix, dirInfos[i].attr, filesize, isoTime(date), dirInfos[i].name);
-        if (dirInfos[i].attr & vfsFileAttrDirectory && depth < listFiles) {
-            listRemoteFiles(volRef, child, depth + 1);
-        }
+/* Open mediaHome/CATALOG_FILE for listRemoteFiles(), keeping the one of the former listing with suffix ".old" to diff them. */
+FILE *catalogOpen(void) {
+    char path[NAME_MAX + sizeof(CATALOG_FILE)], old[sizeof(path) + 4];
+    FILE *fileP;
+
+    mkdir(ctx->mediaHome, 0777); // as only listing doesn't create it
+    strcat(strcpy(path, ctx->mediaHome), CATALOG_FILE);
+    rename(path, strcat(strcpy(old, path), ".old"));
+    if (!(fileP = fopen(path, "w"))) {
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing the list of files\n", MYNAME, path);
+        return NULL;
     }
-    return (PI_ERR)dirItems;
+    jp_logf(L_INFO, "%s: List all files from the Palm device to '%s'\n", MYNAME, path);
+    fprintf(fileP, "volume\tpath\tattributes\tsize\tdate\n");
+    return fileP;
 }
 
-int fileRead(FileRef fileRef, FILE *fileP, pi_buffer_t *buf, int remaining) {
-    buf->used = 0;
-    for (int readsize = 0, todo = remaining > buf->allocated ? buf->allocated : remaining; todo > 0; todo -= readsize) {
-        if (fileRef) {
-            readsize = dlp_VFSFileRead(sd, fileRef, buf, todo);
-            //readsize = dlp_VFSFileRead(sd, fileRef, buf, buf->allocated); // works too, but is very slow
-        } else if (fileP) {
-            readsize = fread(buf->data + buf->used, 1, todo, fileP);
-            buf->used += (size_t)readsize;
-        }
-        if (readsize < 0) {
+/*
+ * List remote files and directories up to depth listFiles into catalog, if not NULL, and to the debug log.
+ * The dirs still to list are kept on a stack on the heap, so deep trees don't grow the call stack. Only with pref
+ * listDetails each item is opened to get its size and date. Returns the number of listed items, or negative PI_ERR,
+ * if rmRoot could not be listed.
+ */
+PI_ERR listRemoteFiles(const int volRef, const char *rmRoot, FILE *catalog) {
+    struct pendingDir {char *path; int depth;} *stack;
+    int count = 0, allocated = 16;
+    PI_ERR result = 0;
+
+    if (!(stack = mallocLog(allocated * sizeof(*stack))) || !(stack[0].path = strdup(rmRoot))) {
+        free(stack);
+        return -1;
+    }
+    stack[count++].depth = 1;
+    while (count) {
+        struct pendingDir dir = stack[--count];
+        dirListing dirList = {0};
+        char prefix[] = MYNAME":                 ";
+
+        prefix[MIN(sizeof(prefix) - 1, strlen(MYNAME) + 1 + dir.depth)] = '\0';
+        int dirItems = cmpExcludeDirList(volRef, dir.path) ? enumerateDir(volRef, dir.path, &dirList) : -1; // avoid bug <https://github.com/desrod/pilot-link/issues/11>
+        logDebug("%s%d remote files in '%s' on Volume %d ...\n", prefix, dirItems, dir.path, volRef);
+        if (dirItems < 0 && dir.depth == 1)  result = dirItems;
+        for (int i = 0; i < dirItems; i++) {
+            dirItem *item = dirList.items + i;
+            char child[strlen(dir.path) + strlen(item->name) + 2];
+            FileRef fileRef;
+            int filesize = 0;
+            time_t date = 0;
+
+            stpcpy(stpcpy(stpcpy(child, strcmp(dir.path, "/") ? dir.path : ""), "/"), item->name);
+            if (!ctx->listDetails) { // only the name and attributes from the enumeration
+            } else if (dlp_VFSFileOpen(ctx->sd, volRef, child, vfsModeRead, &fileRef) < 0) {
+                logDebug("%s WARNING: Cannot get size/date from %s\n", prefix, item->name);
+            } else {
+                if (!(item->attr & vfsFileAttrDirectory) && (dlp_VFSFileSize(ctx->sd, fileRef, &filesize) < 0))
+                    logDebug("%s WARNING: Could not get size   of   %s\n", prefix, item->name);
+                date = getRemoteDate(fileRef, 0, item->name, prefix);
+                dlp_VFSFileClose(ctx->sd, fileRef);
+            }
+            logDebug("%s 0x%02lx%10d %s %s\n", prefix, item->attr, filesize, isoTime(date), item->name);
+            if (catalog) {
+                fprintf(catalog, "%d\t%s\t0x%02lx\t", volRef, child, item->attr);
+                if (ctx->listDetails && !(item->attr & vfsFileAttrDirectory))
+                    fprintf(catalog, "%d", filesize);
+                fprintf(catalog, "\t%s\n", date ? isoTime(date) : "");
+            }
+            result += result >= 0;
+        }
+        for (int i = dirItems - 1; i >= 0; i--) { // push in reverse, so the sub dirs are listed in order
+            dirItem *item = dirList.items + i;
+            if (!(item->attr & vfsFileAttrDirectory) || dir.depth >= ctx->listFiles)
+                continue;
+            struct pendingDir *grown = count < allocated ? stack : realloc(stack, (allocated *= 2) * sizeof(*stack));
+            char *path = grown ? malloc(strlen(dir.path) + strlen(item->name) + 2) : NULL;
+            if (grown)  stack = grown;
+            if (!path) {
+                jp_logf(L_FATAL, "%s: ERROR: Out of memory, so listing not all sub dirs of '%s'\n", MYNAME, dir.path);
+                break;
+            }
+            stpcpy(stpcpy(stpcpy(path, strcmp(dir.path, "/") ? dir.path : ""), "/"), item->name);
+            stack[count++] = (struct pendingDir){path, dir.depth + 1};
+        }
+        dirListingFree(&dirList);
+        free(dir.path);
+    }
+    free(stack);
+    return result;
+}
+
+int fileRead(FileRef fileRef, FILE *fileP, pi_buffer_t *buf, int remaining) {
+    buf->used = 0;
+    for (int readsize = 0, todo = MIN(remaining, fileRef ? chunkSizeOf(ctx->readTuner) : (int)buf->allocated); todo > 0; todo -= readsize) {
+        if (fileRef) {
+            double start = monotonicSecs();
+            readsize = dlp_VFSFileRead(ctx->sd, fileRef, buf, todo);
+            //readsize = dlp_VFSFileRead(sd, fileRef, buf, buf->allocated); // works too, but is very slow
+            tuneChunkSize(ctx->readTuner, readsize, monotonicSecs() - start);
+        } else if (fileP) {
+            if (!(readsize = fread(buf->data + buf->used, 1, todo, fileP)))
+                readsize = -1; // file became shorter or error, so don't loop forever
+            else
+                buf->used += (size_t)readsize;
+        }
+        if (readsize < 0) {
             jp_logf(L_FATAL, "\n%s:       %s on file read, aborting at %d bytes left.\n",
                     MYNAME, errString(fileRef, readsize, L_FATAL, ""), remaining - buf->used);
             return readsize;
@@ -451,402 +1525,1778 @@ int fileRead(FileRef fileRef, FILE *fileP, pi_buffer_t *buf, int remaining) {
 int fileWrite(FileRef fileRef, FILE *fileP, pi_buffer_t *buf, int remaining) {
     for (int writesize = 0, offset = 0; offset < buf->used; offset += writesize) {
         if (fileRef) {
-            writesize = dlp_VFSFileWrite(sd, fileRef, buf->data + offset, buf->used - offset);
+            double start = monotonicSecs();
+            writesize = dlp_VFSFileWrite(ctx->sd, fileRef, buf->data + offset, MIN(buf->used - offset, (size_t)chunkSizeOf(ctx->writeTuner)));
+            tuneChunkSize(ctx->writeTuner, writesize, monotonicSecs() - start);
         } else if (fileP) {
             writesize = fwrite(buf->data + offset, 1, buf->used - offset, fileP);
+            if (!writesize || ferror(fileP)) { // fwrite() is never negative, so 0 on error, i.e. disk full, would loop forever
+                jp_logf(L_FATAL, "\n%s:       ERROR %d: %s on file write, aborting at %d bytes left.\n",
+                        MYNAME, errno, strerror(errno), remaining - offset);
+                return -1;
+            }
+        }
+        if (writesize < 0) {
+            jp_logf(L_FATAL, "\n%s:       %s on file write, aborting at %d bytes left.\n",
+                    MYNAME, errString(fileRef, writesize, L_FATAL, ""), remaining - offset);
+            return writesize;
+        }
+    }
+    return (int)buf->used;
+}
+
+/*
+ * Interrupted transfers are kept as files with PART_SUFFIX, on the computer for backups and on the Palm for restores,
+ * to be resumed on next sync, if the source still has the same size and date. The partial transfers are recorded in
+ * file mediaHome/PARTIALS_FILE as lines of "kind volRef size date\trmPath\tlcPath", which is rewritten on each change,
+ * so it survives a dropped connection. The offset to resume from is the size of the part file.
+ */
+enum partialKind {PARTIAL_BACKUP = 'b', PARTIAL_RESTORE = 'r'};
+
+static void savePartials(void) {
+    char path[NAME_MAX + sizeof(PARTIALS_FILE)];
+    FILE *fileP;
+
+    strcat(strcpy(path, ctx->mediaHome), PARTIALS_FILE);
+    if (!ctx->partials.count) {
+        unlink(path);
+        return;
+    }
+    if (!(fileP = fopen(path, "w"))) {
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing partial transfers\n", MYNAME, path);
+        return;
+    }
+    for (int i = 0; i < ctx->partials.count; i++) {
+        partial *item = ctx->partials.items + i;
+        fprintf(fileP, "%c %d %d %ld\t%s\t%s\n", item->kind, item->volRef, item->size, (long)item->date, item->rmPath, item->lcPath);
+    }
+    fclose(fileP);
+}
+
+void loadPartials(void) {
+    char path[NAME_MAX + sizeof(PARTIALS_FILE)], line[2 * PATH_MAX + 64];
+    FILE *fileP;
+
+    if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), PARTIALS_FILE), "r")))  return;
+    while (fgets(line, sizeof(line), fileP)) {
+        partial item;
+        char kind, *rmPath, *lcPath;
+        long date;
+        partial *items;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%c %d %d %ld", &kind, &item.volRef, &item.size, &date) != 4
+                || !(rmPath = strchr(line, '\t')) || !(lcPath = strchr(++rmPath, '\t')))
+            continue;
+        *lcPath++ = '\0';
+        item.kind = kind;
+        item.date = date;
+        if (!(item.rmPath = strdup(rmPath)) || !(item.lcPath = strdup(lcPath))
+                || !(items = realloc(ctx->partials.items, (ctx->partials.count + 1) * sizeof(*items)))) {
+            free(item.rmPath);
+            free(item.lcPath);
+            continue;
+        }
+        (ctx->partials.items = items)[ctx->partials.count++] = item;
+    }
+    fclose(fileP);
+}
+
+partial *findPartial(const int kind, const int volRef, const char *rmPath) {
+    for (int i = 0; i < ctx->partials.count; i++) {
+        partial *item = ctx->partials.items + i;
+        if (item->kind == kind && item->volRef == volRef && !strcmp(item->rmPath, rmPath))
+            return item;
+    }
+    return NULL;
+}
+
+void dropPartial(partial *item) {
+    if (!item)  return;
+    free(item->rmPath);
+    free(item->lcPath);
+    *item = ctx->partials.items[--ctx->partials.count];
+    savePartials();
+}
+
+void recordPartial(const int kind, const int volRef, const char *rmPath, const char *lcPath, const int size, const time_t date) {
+    partial *items, item = {kind, volRef, size, date, strdup(rmPath), strdup(lcPath)};
+    dropPartial(findPartial(kind, volRef, rmPath));
+    if (!item.rmPath || !item.lcPath || !(items = realloc(ctx->partials.items, (ctx->partials.count + 1) * sizeof(*items)))) {
+        free(item.rmPath);
+        free(item.lcPath);
+        return;
+    }
+    (ctx->partials.items = items)[ctx->partials.count++] = item;
+    savePartials();
+}
+
+void freePartials(void) {
+    for (int i = 0; i < ctx->partials.count; i++) {
+        free(ctx->partials.items[i].rmPath);
+        free(ctx->partials.items[i].lcPath);
+    }
+    free(ctx->partials.items);
+    memset(&ctx->partials, 0, sizeof(ctx->partials));
+}
+
+/*
+ * Map size bytes of a local file for sequential reading, so they can be handed to DLP or memcmp() without copying.
+ * Returns NULL, if the file can't be mapped, i.e. is empty or shorter, so stdio must be used instead.
+ */
+unsigned char *mapLocalFile(FILE *fileP, const int size) {
+    struct stat fileStat;
+    void *map;
+    if (size <= 0 || fstat(fileno(fileP), &fileStat) || fileStat.st_size < size
+            || (map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fileP), 0)) == MAP_FAILED)
+        return NULL;
+    madvise(map, size, MADV_SEQUENTIAL);
+    return map;
+}
+
+/*
+ * Pipelined copy of a file between the Palm and the computer. The DLP side runs in the calling thread and the local
+ * side in a worker thread, which exchange the chunks over a bounded ring of buffers, so DLP traffic never waits for
+ * the local disk. An error on either side stops both, the caller has to remove the partial file.
+ */
+typedef struct copyRing {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned head, tail; // the filled buffers are ringBufs[head ... tail-1 % RING_BUFFERS]
+    int done, error;
+    int filesize;
+    FILE *fileP;
+    int backup; // direction: from the Palm to the computer
+    syncContext *context; // of the sync thread
+} copyRing;
+
+/* Fill free buffers of the ring from the DLP or the local side, until the file is read. */
+static void ringProduce(copyRing *ring, const FileRef fileRef, FILE *fileP) {
+    for (int remaining = ring->filesize; remaining > 0;) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->tail - ring->head == RING_BUFFERS && !ring->error)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        int error = ring->error;
+        pthread_mutex_unlock(&ring->lock);
+        if (error)  break;
+        pi_buffer_t *buf = ctx->ringBufs[ring->tail % RING_BUFFERS];
+        int readsize = fileRead(fileRef, fileP, buf, remaining);
+        pthread_mutex_lock(&ring->lock);
+        if (readsize <= 0)
+            ring->error = 1;
+        else
+            ring->tail++;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        remaining -= readsize;
+    }
+    pthread_mutex_lock(&ring->lock);
+    ring->done = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Drain the filled buffers of the ring to the DLP or the local side, until the producer is done. */
+static void ringConsume(copyRing *ring, const FileRef fileRef, FILE *fileP) {
+    for (int remaining = ring->filesize;;) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->head == ring->tail && !ring->done && !ring->error)
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        int stop = ring->error || ring->head == ring->tail;
+        pthread_mutex_unlock(&ring->lock);
+        if (stop)  break;
+        pi_buffer_t *buf = ctx->ringBufs[ring->head % RING_BUFFERS];
+        int writesize = fileWrite(fileRef, fileP, buf, remaining);
+        pthread_mutex_lock(&ring->lock);
+        if (writesize < 0)
+            ring->error = 1;
+        else
+            ring->head++; // from now on, buf may be refilled by the producer
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        remaining -= writesize;
+    }
+}
+
+static int newRingBuffers(void) {
+    for (int i = 0; i < RING_BUFFERS; i++) {
+        if (!(ctx->ringBufs[i] = pi_buffer_new(CHUNK_MAX)))  return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void *ringLocalSide(void *arg) {
+    copyRing *ring = arg;
+    ctx = ring->context;
+    if (ring->backup)
+        ringConsume(ring, 0, ring->fileP);
+    else
+        ringProduce(ring, 0, ring->fileP);
+    return NULL;
+}
+
+/*
+ * Copy the bytes from offset up to filesize from remote fileRef to local fileP, if backup, otherwise the other way round,
+ * where a mappable local file is written without the ring. The destination must already be positioned at offset.
+ * Returns filesize, or -1 on error.
+ */
+int copyFile(const FileRef fileRef, FILE *fileP, const int offset, const int filesize, const int backup) {
+    copyRing ring = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0, filesize - offset, fileP, backup, ctx};
+    pthread_t worker;
+    unsigned char *map;
+
+    if (!backup && (map = mapLocalFile(fileP, filesize))) { // write straight from the page cache, which reads ahead
+        pi_buffer_t mapped = {.data = map + offset, .allocated = filesize - offset, .used = filesize - offset};
+        int result = fileWrite(fileRef, NULL, &mapped, filesize - offset);
+        munmap(map, filesize);
+        return result < 0 ? -1 : filesize;
+    }
+    if (!backup && offset && fseek(fileP, offset, SEEK_SET))
+        return -1;
+    if (pthread_create(&worker, NULL, ringLocalSide, &ring)) { // so alternate in this thread
+        for (int remaining = filesize - offset; remaining > 0; remaining -= ctx->ringBufs[0]->used) {
+            if (fileRead(backup ? fileRef : 0, fileP, ctx->ringBufs[0], remaining) <= 0
+                    || fileWrite(backup ? 0 : fileRef, fileP, ctx->ringBufs[0], remaining) < 0)
+                return -1;
+        }
+        return filesize;
+    }
+    if (backup)
+        ringProduce(&ring, fileRef, NULL);
+    else
+        ringConsume(&ring, fileRef, NULL);
+    pthread_join(worker, NULL);
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.changed);
+    return ring.error ? -1 : filesize;
+}
+
+int fileCompare(FileRef fileRef, FILE *fileP, int filesize) {
+    int result = 0;
+    unsigned char *map = mapLocalFile(fileP, filesize);
+    for (int todo = filesize; todo > 0; todo -= ctx->piBuf->used) {
+        if (fileRead(fileRef, NULL, ctx->piBuf, todo) < 0 ||
+                (!map && (fileRead(0, fileP, ctx->piBuf2, ctx->piBuf->used) < 0 || ctx->piBuf->used != ctx->piBuf2->used))) {
+            jp_logf(L_FATAL, "%s:       ERROR reading files for comparison, so assuming different ...\n", MYNAME);
+            logDebug("%s:       filesize=%d, todo=%d, piBuf->used=%d, piBuf2->used=%d\n", MYNAME, filesize, todo, ctx->piBuf->used, ctx->piBuf2->used);
+            result = -1; // remember error
+            break;
+        }
+        if ((result = memcmp(ctx->piBuf->data, map ? map + filesize - todo : ctx->piBuf2->data, ctx->piBuf->used))) {
+            break; // Files have different content.
+        }
+    }
+    if (map)  munmap(map, filesize);
+    return result;
+}
+
+/*
+ * Hash index over the names of a remote dir listing, built once after enumeration,
+ * so searching a local name in it costs O(1) instead of a linear scan.
+ * If out of memory, cmpRemote() falls back to the linear scan.
+ */
+void nameIndexBuild(nameIndex *index, const dirListing *list) {
+    unsigned size = 16;
+    index->list = list;
+    index->slots = NULL;
+    if (list->count <= 0)  return;
+    while (size < 2 * (unsigned)list->count)  size *= 2; // keep load factor <= 0.5
+    if (!(index->slots = malloc(size * sizeof(*index->slots))))  return;
+    index->mask = size - 1;
+    memset(index->slots, -1, size * sizeof(*index->slots));
+    for (int i = 0; i < list->count; i++) {
+        unsigned slot = hashName(list->items[i].name) & index->mask;
+        while (index->slots[slot] >= 0)  slot = (slot + 1) & index->mask;
+        index->slots[slot] = i;
+    }
+}
+
+void nameIndexFree(nameIndex *index) {
+    free(index->slots);
+    index->slots = NULL;
+}
+
+/* Returns the item of fname in the indexed dir listing, or NULL, if not found. */
+const dirItem *nameIndexFind(const nameIndex *index, const char *fname) {
+    if (!index->slots) {
+        for (int i = 0; i < index->list->count; i++) {
+            if (!strcmp(fname, index->list->items[i].name))  return index->list->items + i;
+        }
+        return NULL;
+    }
+    for (unsigned slot = hashName(fname) & index->mask; index->slots[slot] >= 0; slot = (slot + 1) & index->mask) {
+        if (!strcmp(fname, index->list->items[index->slots[slot]].name))  return index->list->items + index->slots[slot];
+    }
+    return NULL;
+}
+
+/* Returns 0, if fname is found in the remote dir listing, otherwise 1. */
+int cmpRemote(const nameIndex *index, const char *fname) {
+    return !nameIndexFind(index, fname);
+}
+
+/*
+ * The sync manifest remembers size, remote date and local date of all files, which were found in sync,
+ * keyed by "volRef:rmPath". It is stored sorted by key in file mediaHome/MANIFEST_FILE, so it can be
+ * mmap'ed and binary searched without parsing, even for huge libraries.
+ * File layout: manifestHeader, manifestEntry[count], keys as '\0'-terminated strings of keysSize bytes.
+ * New entries are collected in manifest.updates and merged into a new file by manifestSave().
+ */
+static const char MANIFEST_MAGIC[8] = "MediaMF1";
+typedef struct manifestHeader {char magic[8]; uint32_t count; uint32_t keysSize;} manifestHeader;
+
+static char *manifestKey(char *key, const size_t size, const int volRef, const char *rmPath) {
+    snprintf(key, size, "%d:%s", volRef, rmPath);
+    return key;
+}
+
+void manifestLoad(void) {
+    char path[NAME_MAX + sizeof(MANIFEST_FILE)];
+    struct stat fileStat;
+    void *map;
+    int fd;
+
+    if ((fd = open(strcat(strcpy(path, ctx->mediaHome), MANIFEST_FILE), O_RDONLY)) < 0) {
+        logDebug("%s: No sync manifest '%s' found, errno=%d\n", MYNAME, path, errno);
+        return;
+    }
+    if (!fstat(fd, &fileStat) && fileStat.st_size >= sizeof(manifestHeader)
+            && (map = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        const manifestHeader *header = map;
+        const manifestEntry *entries = (const manifestEntry *)(header + 1);
+        const char *keys = (const char *)(entries + header->count);
+        if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC))
+                || fileStat.st_size != sizeof(*header) + (size_t)header->count * sizeof(manifestEntry) + header->keysSize
+                || (header->keysSize && keys[header->keysSize - 1])) {
+            jp_logf(L_WARN, "%s: WARNING: Sync manifest '%s' is corrupt, so ignoring it.\n", MYNAME, path);
+            munmap(map, fileStat.st_size);
+        } else {
+            ctx->manifest.map = map;
+            ctx->manifest.mapSize = fileStat.st_size;
+            ctx->manifest.entries = entries;
+            ctx->manifest.keys = keys;
+            ctx->manifest.count = header->count;
+            logDebug("%s: Loaded sync manifest '%s' with %u entries\n", MYNAME, path, ctx->manifest.count);
+        }
+    }
+    close(fd);
+}
+
+/* Binary search in the mmap'ed manifest; returns NULL if not found. */
+const manifestEntry *manifestLookup(const char *key) {
+    for (uint32_t lo = 0, hi = ctx->manifest.count; lo < hi;) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(key, ctx->manifest.keys + ctx->manifest.entries[mid].keyOffset);
+        if (!cmp)  return ctx->manifest.entries + mid;
+        if (cmp < 0)  hi = mid;
+        else  lo = mid + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Tells, if the remote size and date, which are already known from the listed item or the metadata cache, still match
+ * the manifest entry, so a file replaced on the Palm is not skipped only by its unchanged local copy.
+ */
+static int manifestRemoteMatch(const manifestEntry *known, const int volRef, const char *rmPath, const dirItem *item) {
+    remoteMeta *meta = metaFind(volRef, rmPath, 0);
+    if ((item && item->size >= 0 && item->size != known->size)
+            || (item && item->date && known->rmDate && item->date != known->rmDate)
+            || (meta && meta->flags & META_SIZE && meta->size != known->size)
+            || (meta && meta->flags & META_DATE && known->rmDate && meta->date != known->rmDate)) {
+        logDebug("%s:       Remote file '%s' changed since last sync, so comparing it.\n", MYNAME, rmPath);
+        return 0;
+    }
+    return 1;
+}
+
+void manifestRecord(const char *key, const int size, const time_t rmDate, const time_t lcDate) {
+    if (ctx->manifest.updated >= ctx->manifest.allocated) {
+        unsigned allocated = ctx->manifest.allocated ? ctx->manifest.allocated * 2 : 256;
+        manifestUpdate *updates = realloc(ctx->manifest.updates, allocated * sizeof(*updates));
+        if (!updates) {
+            jp_logf(L_WARN, "%s: WARNING: Out of memory, so not recording '%s' in sync manifest\n", MYNAME, key);
+            return;
+        }
+        ctx->manifest.updates = updates;
+        ctx->manifest.allocated = allocated;
+    }
+    manifestUpdate *update = ctx->manifest.updates + ctx->manifest.updated;
+    if ((update->key = strdup(key))) {
+        update->size = size;
+        update->rmDate = rmDate;
+        update->lcDate = lcDate;
+        ctx->manifest.updated++;
+    }
+}
+
+/*
+ * Mark the entries of remote album rmPath on volume volRef, which are missing in its complete listing remoteNames,
+ * so manifestSave() drops them. As the keys are sorted, the entries of the album are found by one binary search.
+ * The entries of its sub albums are left to these.
+ */
+static void manifestListed(const int volRef, const char *rmPath, const nameIndex *remoteNames) {
+    char prefix[strlen(rmPath) + 14];
+    size_t length = snprintf(prefix, sizeof(prefix), "%d:%s/", volRef, rmPath);
+    uint32_t lo = 0;
+    for (uint32_t hi = ctx->manifest.count; lo < hi;) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(ctx->manifest.keys + ctx->manifest.entries[mid].keyOffset, prefix) < 0)  lo = mid + 1;
+        else  hi = mid;
+    }
+    for (; lo < ctx->manifest.count; lo++) {
+        const char *key = ctx->manifest.keys + ctx->manifest.entries[lo].keyOffset;
+        if (strncmp(key, prefix, length))  break;
+        if (strchr(key + length, '/') || nameIndexFind(remoteNames, key + length))  continue;
+        if (!ctx->manifest.dropped && !(ctx->manifest.dropped = calloc((ctx->manifest.count + 7) / 8, 1)))  return;
+        if (!(ctx->manifest.dropped[lo / 8] & 1 << lo % 8)) {
+            ctx->manifest.dropped[lo / 8] |= 1 << lo % 8;
+            ctx->manifest.droppedCount++;
+            logDebug("%s:      Dropping '%s' from sync manifest, as it is gone from the Palm\n", MYNAME, key);
+        }
+    }
+}
+
+static int cmpManifestUpdate(const void *a, const void *b) {
+    return strcmp(((const manifestUpdate *)a)->key, ((const manifestUpdate *)b)->key);
+}
+
+/*
+ * Merge the recorded updates with the loaded manifest into a new manifest file, which then atomically replaces the old one.
+ * The entries marked by manifestListed() are dropped. EXIT_SUCCESS is returned on success, otherwise EXIT_FAILURE.
+ */
+int manifestSave(void) {
+    if (!ctx->manifest.updated && !ctx->manifest.droppedCount)  return EXIT_SUCCESS;
+    qsort(ctx->manifest.updates, ctx->manifest.updated, sizeof(*ctx->manifest.updates), cmpManifestUpdate);
+
+    char path[NAME_MAX + sizeof(MANIFEST_FILE)], tmpPath[sizeof(path) + 4];
+    strcat(strcpy(path, ctx->mediaHome), MANIFEST_FILE);
+    strcat(strcpy(tmpPath, path), ".tmp");
+    FILE *fileP;
+    if (!(fileP = fopen(tmpPath, "w"))) {
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing sync manifest\n", MYNAME, tmpPath);
+        return EXIT_FAILURE;
+    }
+    manifestEntry *entries = mallocLog((ctx->manifest.count + ctx->manifest.updated) * sizeof(*entries));
+    size_t keysSize = 0, keysAllocated = 0;
+    char *keys = NULL;
+    uint32_t count = 0;
+    int result = entries ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (uint32_t o = 0, u = 0; result == EXIT_SUCCESS; count++) {
+        while (o < ctx->manifest.count && ctx->manifest.dropped && ctx->manifest.dropped[o / 8] & 1 << o % 8)  o++;
+        if (o >= ctx->manifest.count && u >= ctx->manifest.updated)  break;
+        const char *oldKey = o < ctx->manifest.count ? ctx->manifest.keys + ctx->manifest.entries[o].keyOffset : NULL;
+        const manifestUpdate *update = u < ctx->manifest.updated ? ctx->manifest.updates + u : NULL;
+        int cmp = !oldKey ? 1 : !update ? -1 : strcmp(oldKey, update->key);
+        const char *key;
+        if (cmp < 0) {
+            entries[count] = ctx->manifest.entries[o++];
+            key = oldKey;
+        } else {
+            entries[count] = (manifestEntry){0, update->size, update->rmDate, update->lcDate};
+            key = update->key;
+            if (!cmp)  o++; // update replaces old entry
+            // skip duplicates, recorded in the same sync
+            for (u++; u < ctx->manifest.updated && !strcmp(key, ctx->manifest.updates[u].key); u++);
+        }
+        size_t len = strlen(key) + 1;
+        if (keysSize + len > keysAllocated) {
+            char *newKeys = realloc(keys, keysAllocated = MAX(2 * keysAllocated, keysSize + len + 4096));
+            if (!newKeys) {
+                result = EXIT_FAILURE;
+                break;
+            }
+            keys = newKeys;
+        }
+        entries[count].keyOffset = keysSize;
+        memcpy(keys + keysSize, key, len);
+        keysSize += len;
+    }
+    if (result == EXIT_SUCCESS) {
+        manifestHeader header;
+        memcpy(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+        header.count = count;
+        header.keysSize = keysSize;
+        if (fwrite(&header, sizeof(header), 1, fileP) != 1
+                || fwrite(entries, sizeof(*entries), count, fileP) != count
+                || fwrite(keys, 1, keysSize, fileP) != keysSize)
+            result = EXIT_FAILURE;
+    }
+    free(entries);
+    free(keys);
+    if (fclose(fileP) || result != EXIT_SUCCESS || rename(tmpPath, path)) {
+        jp_logf(L_WARN, "%s: WARNING: Could not write sync manifest '%s'\n", MYNAME, path);
+        unlink(tmpPath);
+        return EXIT_FAILURE;
+    }
+    logDebug("%s: Saved sync manifest '%s' with %u entries, %u updated, %u dropped\n", MYNAME, path, count, ctx->manifest.updated, ctx->manifest.droppedCount);
+    return EXIT_SUCCESS;
+}
+
+void manifestFree(void) {
+    if (ctx->manifest.map)  munmap(ctx->manifest.map, ctx->manifest.mapSize);
+    for (unsigned i = 0; i < ctx->manifest.updated; i++)
+        free(ctx->manifest.updates[i].key);
+    free(ctx->manifest.updates);
+    free(ctx->manifest.dropped);
+    memset(&ctx->manifest, 0, sizeof(ctx->manifest));
+}
+
+/*
+ * The sync journal records the completed albums and files, while a sync progresses, so a sync, which was cancelled
+ * or lost the connection, is continued by the next HotSync without walking the completed albums and files again.
+ * It is appended to file mediaHome/JOURNAL_FILE line by line and flushed after each line, so it survives a killed
+ * sync. A completed album is only skipped, if the dates of its remote and local dir have not changed since.
+ * Lines: "J userID" as header, "A rmDate lcDate\tvolRef:rmPath" per album and "F\tvolRef:rmPath" per file.
+ * After a sync without errors and deferred files, the journal is removed.
+ */
+
+
+static int cmpJournalEntry(const void *a, const void *b) {
+    return strcmp(((const journalEntry *)a)->key, ((const journalEntry *)b)->key);
+}
+
+/* Load the journal of an unfinished sync of this device. */
+void journalLoad(void) {
+    char path[NAME_MAX + sizeof(JOURNAL_FILE)], line[PATH_MAX + 64];
+    FILE *fileP;
+    unsigned long journalUserID;
+
+    strcat(strcpy(path, ctx->mediaHome), JOURNAL_FILE);
+    if ((fileP = fopen(path, "r"))) {
+        if (fgets(line, sizeof(line), fileP) && sscanf(line, "J %lu", &journalUserID) == 1 && journalUserID == ctx->userID) {
+            while (fgets(line, sizeof(line), fileP)) {
+                journalEntry item = {0}, *items;
+                long rmDate = 0, lcDate = 0;
+                char *key, *end = strchr(line, '\n');
+                if (!end) { // skip the torn last line of a killed sync
+                    ctx->journal.torn = 1;
+                    continue;
+                }
+                if (!(key = strchr(line, '\t')))  continue;
+                *end = '\0';
+                if ((line[0] != 'A' || sscanf(line, "A %ld %ld", &rmDate, &lcDate) != 2) && line[0] != 'F')  continue;
+                item.kind = line[0];
+                item.rmDate = rmDate;
+                item.lcDate = lcDate;
+                if (!(item.key = strdup(key + 1)) || !(items = realloc(ctx->journal.items, (ctx->journal.count + 1) * sizeof(*items)))) {
+                    free(item.key);
+                    continue;
+                }
+                (ctx->journal.items = items)[ctx->journal.count++] = item;
+            }
+            qsort(ctx->journal.items, ctx->journal.count, sizeof(*ctx->journal.items), cmpJournalEntry);
+            jp_logf(L_INFO, "%s: Continue unfinished sync from journal '%s' with %d entries\n", MYNAME, path, ctx->journal.count);
+        }
+        fclose(fileP);
+    }
+}
+
+/* Returns the entry of rmPath, if completed by the unfinished sync, otherwise NULL. */
+const journalEntry *journalLookup(const int volRef, const char *rmPath) {
+    char key[strlen(rmPath) + 12];
+    journalEntry item = {0, 0, 0, manifestKey(key, sizeof(key), volRef, rmPath)};
+    return ctx->journal.count ? bsearch(&item, ctx->journal.items, ctx->journal.count, sizeof(*ctx->journal.items), cmpJournalEntry) : NULL;
+}
+
+/* Returns 1, if the album was completed by the unfinished sync and its dirs have not changed since, otherwise 0. */
+int journalAlbumDone(const int volRef, const char *rmPath, const char *lcPath) {
+    const journalEntry *item = journalLookup(volRef, rmPath);
+    if (!item || item->kind != 'A' || getLocalDate(lcPath) != item->lcDate || getRemoteDate(0, volRef, rmPath, NULL) != item->rmDate)
+        return 0;
+    logDebug("%s:    Album '%s' on volume %d was completed by the unfinished sync, skipping it.\n", MYNAME, rmPath, volRef);
+    return 1;
+}
+
+/* Returns 1, if file in rmDir was completed by the unfinished sync, otherwise 0. */
+int journalFileDone(const int volRef, const char *rmDir, const char *file) {
+    if (!ctx->journal.count)  return 0;
+    char rmPath[strlen(rmDir) + strlen(file) + 2];
+    const journalEntry *item = journalLookup(volRef, strcat(strcat(strcpy(rmPath, rmDir), "/"), file));
+    return item && item->kind == 'F';
+}
+
+/* Record a completed album with its dir dates, or a completed file, if rmDate is 0. */
+void journalRecord(const int volRef, const char *rmPath, const time_t rmDate, const time_t lcDate) {
+    char path[NAME_MAX + sizeof(JOURNAL_FILE)];
+    if (ctx->dryRun)  return;
+    pthread_mutex_lock(&ctx->journalLock);
+    if (!ctx->journal.opened) { // first when mediaHome surely exists
+        ctx->journal.opened = 1;
+        if (!(ctx->journal.fileP = fopen(strcat(strcpy(path, ctx->mediaHome), JOURNAL_FILE), ctx->journal.count ? "a" : "w")))
+            jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing the sync journal\n", MYNAME, path);
+        else if (!ctx->journal.count)
+            fprintf(ctx->journal.fileP, "J %lu\n", ctx->userID);
+        else if (ctx->journal.torn)
+            fputc('\n', ctx->journal.fileP);
+    }
+    if (ctx->journal.fileP) {
+        if (rmDate)
+            fprintf(ctx->journal.fileP, "A %ld %ld\t%d:%s\n", (long)rmDate, (long)lcDate, volRef, rmPath);
+        else
+            fprintf(ctx->journal.fileP, "F\t%d:%s\n", volRef, rmPath);
+        fflush(ctx->journal.fileP);
+    }
+    pthread_mutex_unlock(&ctx->journalLock);
+}
+
+/* Close the journal, and remove it, if the sync was completed. */
+void journalClose(const int completed) {
+    char path[NAME_MAX + sizeof(JOURNAL_FILE)];
+    if (ctx->journal.fileP)
+        fclose(ctx->journal.fileP);
+    if ((ctx->journal.fileP || ctx->journal.count) && completed && !ctx->journal.incomplete && !ctx->dryRun)
+        unlink(strcat(strcpy(path, ctx->mediaHome), JOURNAL_FILE));
+    for (int i = 0; i < ctx->journal.count; i++)
+        free(ctx->journal.items[i].key);
+    free(ctx->journal.items);
+    memset(&ctx->journal, 0, sizeof(ctx->journal));
+}
+
+/*
+ * Backup a file from the Palm device, if not existent or different.
+ */
+int backupFileIfNeeded(const unsigned volRef, const char *rmDir, const char *lcDir, const char *file) {
+    logDebug("%s:      backupFileIfNeeded(volRef=%d, rmDir='%s', lcDir='%s', file='%s')\n", MYNAME, volRef, rmDir, lcDir, file);
+    char rmPath[strlen(rmDir) + strlen(file) + 2];
+    char lcPath[strlen(lcDir) + strlen(file) + 4]; // prepare for possible rename
+    char lcPart[sizeof(lcPath) + sizeof(PART_SUFFIX)];
+    FileRef fileRef;
+    FILE *fileP;
+    int filesize; // also serves as error return code
+
+    stpcpy(stpcpy(stpcpy(rmPath, rmDir), "/"), file);
+    stpcpy(stpcpy(stpcpy(lcPath, lcDir), "/"), file);
+
+    selectChunkTuners(volRef);
+
+    // Skip all DLP calls, if the local file is still the same, which was found in sync before.
+    char key[sizeof(rmPath) + 12];
+    const manifestEntry *known;
+    struct stat fstat;
+    int statErr = stat(lcPath, &fstat);
+    manifestKey(key, sizeof(key), volRef, rmPath);
+    if (ctx->useManifest && !ctx->compareContent && !statErr && (known = manifestLookup(key))
+            && fstat.st_size == known->size && fstat.st_mtime == known->lcDate && manifestRemoteMatch(known, volRef, rmPath, NULL)) {
+        logDebug("%s:       File '%s' is unchanged since last sync, not copying it.\n", MYNAME, lcPath);
+        return known->size;
+    }
+
+    // Also skip them, if the album index tells the same size and date as of the local file.
+    remoteMeta *indexed;
+    if (!ctx->compareContent && !statErr && (indexed = metaGet(volRef, rmPath, META_SIZE | META_DATE, 4))
+            && fstat.st_size == indexed->size && fstat.st_mtime == indexed->date) {
+        logDebug("%s:       File '%s' already exists with the indexed size and date, not copying it.\n", MYNAME, lcPath);
+        if (ctx->useManifest)  manifestRecord(key, indexed->size, indexed->date, fstat.st_mtime);
+        return indexed->size;
+    }
+
+    if (piErrLog(dlp_VFSFileOpen(ctx->sd, volRef, rmPath, vfsModeRead, &fileRef),
+            L_FATAL, volRef, rmPath, "      ", ": Could not open remote file","") < 0)
+        return -1;
+    else if (piErrLog(dlp_VFSFileSize(ctx->sd, fileRef, &filesize),
+            L_WARN, volRef, rmPath, "      ", ": Could not get size of", ", so anyway backup it.") < 0)
+        filesize = 0;
+    if ((indexed = metaFind(volRef, rmPath, 0)) && indexed->flags & META_SIZE && indexed->size != filesize) {
+        logDebug("%s:       Indexed size %ld of '%s' is outdated, so ignoring its index record.\n", MYNAME, indexed->size, rmPath);
+        indexed->flags &= ~(META_SIZE | META_DATE);
+    }
+
+    if (!statErr) {
+        int equal = 0;
+        if (fstat.st_size != filesize) {
+            jp_logf(L_WARN, "%s:       WARNING: File '%s' already exists, but has different size %d vs. %d,\n", MYNAME, lcPath, fstat.st_size, filesize);
+        } else if (!ctx->compareContent) {
+            equal = 1;
+        } else {
+            FILE *fileP;
+            if (!(fileP = fopen(lcPath, "r"))) {
+                jp_logf(L_WARN, "%s:       WARNING: Cannot open %s for comparing %d bytes, so may have different content,\n", MYNAME, lcPath, filesize);
+            } else {
+                if (!(equal = !fileCompare(fileRef, fileP, filesize)))
+                    jp_logf(L_WARN, "%s:       WARNING: File '%s' already exists, but has different content,\n", MYNAME, lcPath);
+                fclose(fileP);
+                if (piErrLog(dlp_VFSFileSeek(ctx->sd, fileRef, vfsOriginBeginning, 0),
+                        L_FATAL, volRef, file, "      ", ": Could not rewind file", ", so can not copy it, aborting ...") < 0) {
+                    filesize = -1; // remember error
+                    goto Exit;
+                }
+            }
+        }
+        if (equal) {
+            logDebug("%s:       File '%s' already exists, not copying it.\n", MYNAME, lcPath);
+            if (ctx->useManifest)  manifestRecord(key, filesize, getRemoteDate(fileRef, volRef, rmPath, NULL), fstat.st_mtime);
+            goto Exit;
+        }
+        // Find alternative destination file name, which not alredy exists, by inserting a number.
+        char *i = lcPath + strlen(lcPath), *insert = strrchr(lcPath, '.');
+        insert = insert ? insert : i; // correct if there was no '.'
+        for (; i >= insert; i--)  *(i + 2) = *i;
+        *insert++ = '_';  *insert = '1';
+        for (; !stat(lcPath, &fstat); (*insert)++) {; // increment number by 1
+            if (*insert >= '9') {
+                jp_logf(L_WARN, "%s:               and even file '%s' already exists, so no new backup for '%s'.\n", MYNAME, lcPath, file);
+                filesize = -1; // remember error
+                goto Exit;
+            }
+        }
+        jp_logf(L_WARN, "%s:               so backup to '%s'.\n", MYNAME, lcPath);
+    }
+    // File has not already been synced, backup it to the part file, which is resumed, if left from an interrupted backup.
+    struct stat partStat;
+    partial *part = findPartial(PARTIAL_BACKUP, volRef, rmPath);
+    time_t date = getRemoteDate(fileRef, volRef, rmPath, NULL); // the date on that the picture was created
+    int offset = 0, rmSize = filesize;
+    strcat(strcpy(lcPart, lcPath), PART_SUFFIX);
+    if (part && !strcmp(part->lcPath, lcPath) && part->size == filesize && part->date == date
+            && !stat(lcPart, &partStat) && partStat.st_size <= filesize
+            && dlp_VFSFileSeek(ctx->sd, fileRef, vfsOriginBeginning, partStat.st_size) >= 0)
+        offset = partStat.st_size;
+    if (!(fileP = fopen(lcPart, offset ? "a" : "w"))) {
+        jp_logf(L_FATAL, "%s:       ERROR: Cannot open %s for writing %d bytes!\n", MYNAME, lcPart, filesize);
+        filesize = -1; // remember error
+        goto Exit;
+    }
+    // Copy file.
+    if (offset)
+        jp_logf(L_INFO, "%s:      Resume backup '%s', size %d at %d ...", MYNAME, rmPath, filesize, offset);
+    else
+        jp_logf(L_INFO, "%s:      Backup '%s', size %d ...", MYNAME, rmPath, filesize);
+    if (copyFile(fileRef, fileP, offset, filesize, 1) < 0)
+        filesize = -1; // remember error
+    if (fclose(fileP) && filesize >= 0) {
+        jp_logf(L_FATAL, "\n%s:       ERROR: Could not finish writing %s\n", MYNAME, lcPart);
+        filesize = -1; // remember error
+    }
+    if (filesize < 0) { // keep the partially created file
+        recordPartial(PARTIAL_BACKUP, volRef, rmPath, lcPath, rmSize, date);
+        jp_logf(L_WARN, "%s:       WARNING: Kept incomplete local file '%s' to resume on next sync\n", MYNAME, lcPart);
+    } else if (rename(lcPart, lcPath)) {
+        jp_logf(L_FATAL, "\n%s:       ERROR: Could not rename %s to %s\n", MYNAME, lcPart, lcPath);
+        unlink(lcPart);
+        filesize = -1; // remember error
+    } else {
+        jp_logf(L_INFO, " OK\n");
+        dropPartial(part);
+        if (date)  queueLocalDate(lcPath, date, 0);
+        if (ctx->useManifest && statErr)  manifestRecord(key, filesize, date, date ? date : getLocalDate(lcPath)); // not if renamed
+    }
+Exit:
+    dlp_VFSFileClose(ctx->sd, fileRef);
+    logDebug("%s:       Backup file size / copy result: %d, statErr=%d\n", MYNAME, filesize, statErr);
+    return filesize;
+}
+
+/*
+ * Restore a file to the remote Palm device.
+ */
+int restoreFile(const char *lcDir, const unsigned volRef, const char *rmDir, const char *file) {
+    logDebug("%s:      restoreFile(lcDir='%s', volRef=%d, rmDir='%s', file='%s')\n", MYNAME, lcDir, volRef, rmDir, file);
+    char lcPath[strlen(lcDir) + strlen(file) + 2];
+    char rmPath[strlen(rmDir) + strlen(file) + 2];
+    FILE *fileP;
+    FileRef fileRef;
+    int filesize; // also serves as error return
+
+    stpcpy(stpcpy(stpcpy(lcPath, lcDir), "/"), file);
+    stpcpy(stpcpy(stpcpy(rmPath, rmDir), "/"), file);
+
+    struct stat fstat;
+    int statErr;
+    if ((statErr = stat(lcPath, &fstat))) {
+        jp_logf(L_FATAL, "%s:       ERROR %d: Could not read status of %s.\n", MYNAME, statErr, lcPath);
+        return -1;
+    }
+    filesize = fstat.st_size;
+    if (!(fileP = fopen(lcPath, "r"))) {
+        jp_logf(L_FATAL, "%s:       ERROR: Could not open %s for reading %d bytes,\n", MYNAME, lcPath, filesize);
+        return -1;
+    }
+    // Restore to the part file, which is resumed, if left from an interrupted restore of the same local file.
+    char rmPart[sizeof(rmPath) + sizeof(PART_SUFFIX)];
+    partial *part = findPartial(PARTIAL_RESTORE, volRef, rmPath);
+    int offset = 0;
+    strcat(strcpy(rmPart, rmPath), PART_SUFFIX);
+    if (part && part->size == filesize && part->date == fstat.st_mtime
+            && dlp_VFSFileOpen(ctx->sd, volRef, rmPart, vfsModeReadWrite, &fileRef) >= 0) {
+        if (dlp_VFSFileSize(ctx->sd, fileRef, &offset) < 0 || offset > filesize
+                || dlp_VFSFileSeek(ctx->sd, fileRef, vfsOriginBeginning, offset) < 0) {
+            offset = 0;
+            dlp_VFSFileClose(ctx->sd, fileRef);
+        }
+    }
+    if (!offset && part)
+        dlp_VFSFileDelete(ctx->sd, volRef, rmPart); // stale part file, as the local file has changed
+    if (!offset && piErrLog(dlp_VFSFileOpen(ctx->sd, volRef, rmPart, vfsModeReadWrite | vfsModeCreate, &fileRef),
+            L_FATAL, volRef, rmPart, "      ", ": Could not open remote file", " for read/writing.") < 0) { // May not work on DLP,
+    //~ // ... then first create file with:
+    //~ if (piErrLog(dlp_VFSFileCreate(sd, volRef, rmPath), L_FATAL, volRef, rmPath, "      ", ": Could not create remote file","") < 0 ||
+            //~ (piErrLog(dlp_VFSFileOpen(sd, volRef, rmPath, vfsModeWrite, &fileRef), // See: https://github.com/desrod/pilot-link/issues/10
+            //~ (piErrLog(dlp_VFSFileOpen(sd, volRef, rmPath, vfsModeReadWrite, &fileRef),
+            //~ L_FATAL, volRef, rmPath, "      ", ": Could not open remote file", " for read/writing.") < 0) {
+        filesize = -1; // remember error
+        goto Exit;
+    }
+    // Copy file.
+    selectChunkTuners(volRef);
+    if (offset)
+        jp_logf(L_INFO, "%s:      Resume restore '%s', size %d at %d ...", MYNAME, lcPath, filesize, offset);
+    else
+        jp_logf(L_INFO, "%s:      Restore '%s', size %d ...", MYNAME, lcPath, filesize);
+    if (copyFile(fileRef, fileP, offset, filesize, 0) < 0)
+        filesize = -1; // remember error
+    metaInvalidate(volRef, rmPart, META_EXISTS | META_DATE | META_ATTR | META_SIZE); // also invalidates date of rmDir, which changed by writing
+    if (filesize >= 0)
+        setRemoteDate(fileRef, volRef, rmPart, fstat.st_mtime);
+    dlp_VFSFileClose(ctx->sd, fileRef);
+    if (filesize < 0) { // keep the partially created file
+        recordPartial(PARTIAL_RESTORE, volRef, rmPath, lcPath, (int)fstat.st_size, fstat.st_mtime);
+        jp_logf(L_WARN, "%s:       WARNING: Kept incomplete remote file '%s' on volume %d to resume on next sync\n", MYNAME, rmPart, volRef);
+    } else if (piErrLog(dlp_VFSFileRename(ctx->sd, volRef, rmPart, file),
+            L_FATAL, volRef, rmPart, "      ", ": Could not rename remote file", "") < 0) {
+        dlp_VFSFileDelete(ctx->sd, volRef, rmPart);
+        filesize = -1; // remember error
+    } else {
+        jp_logf(L_INFO, " OK\n");
+        dropPartial(part);
+        metaInvalidate(volRef, rmPath, META_EXISTS | META_DATE | META_ATTR | META_SIZE);
+        if (ctx->useManifest) {
+            char key[sizeof(rmPath) + 12];
+            manifestRecord(manifestKey(key, sizeof(key), volRef, rmPath), filesize, fstat.st_mtime, fstat.st_mtime);
+        }
+    }
+
+Exit:
+    fclose(fileP);
+    logDebug("%s:       Restore file size / copy result: %d, statErr=%d\n", MYNAME, filesize, statErr);
+    return filesize;
+}
+
+/*
+ * The sync of a root dir runs in 3 phases: First snapshotRoot() takes the listings of the remote and the local albums,
+ * then diffSnapshot() derives the ordered plan of operations from them without any I/O, and at last executePlan()
+ * runs the plan. With pref dryRun, the plan is only logged with its byte totals and estimated duration.
+ * The snapshot and the plan are declared in media.h.
+ */
+static const char *PLAN_OP_NAMES[] = {"create local dir", "create remote dir", "restore", "backup", "move local file", "link local file", "set local dir date"};
+static const int PLAN_OP_CALLS[] = {3, 5, 6, 5, 4, 4, 3}; // estimated DLP round trips beside the data transfer
+#define EST_CALL_SECS 0.02 // estimates, if nothing measured yet
+#define EST_BYTES_PER_SEC 100000.0
+albumSnapshot *addAlbumSnapshot(rootSnapshot *snap, const char *name, const int onRemote, const int onLocal) {
+    albumSnapshot *albums = realloc(snap->albums, (snap->count + 1) * sizeof(*albums)), *album;
+    if (!albums) {
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        return NULL;
+    }
+    album = (snap->albums = albums) + snap->count;
+    memset(album, 0, sizeof(*album));
+    album->onRemote = onRemote;
+    album->onLocal = onLocal;
+    if (!name) {
+        album->rmPath = strdup(snap->rmRoot);
+        album->lcPath = strdup(snap->lcRoot);
+    } else if ((album->name = strdup(name))
+            && (album->rmPath = malloc(strlen(snap->rmRoot) + strlen(name) + 2))
+            && (album->lcPath = malloc(strlen(snap->lcRoot) + strlen(name) + 2))) {
+        stpcpy(stpcpy(stpcpy(album->rmPath, snap->rmRoot), "/"), name);
+        stpcpy(stpcpy(stpcpy(album->lcPath, snap->lcRoot), "/"), name);
+    }
+    if (!album->rmPath || !album->lcPath) {
+        free(album->name);
+        free(album->rmPath);
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        return NULL;
+    }
+    snap->count++;
+    return album;
+}
+
+void freeSnapshot(rootSnapshot *snap) {
+    for (int i = 0; i < snap->count; i++) {
+        albumSnapshot *album = snap->albums + i;
+        free(album->name);
+        free(album->rmPath);
+        free(album->lcPath);
+        dirListingFree(&album->rmList);
+        dirListingFree(&album->lcList);
+    }
+    free(snap->albums);
+    free(snap->rmRoot);
+    free(snap->lcRoot);
+    memset(snap, 0, sizeof(*snap));
+}
+
+typedef struct indexTask {poolTask task; dirListing list; int errors; char path[];} indexTask;
+
+static void runIndexTask(poolTask *task) {
+    indexTask *it = (indexTask *)task;
+    it->errors = indexLocalDir(it->path, &it->list);
+}
+
+/* Index the local album name in lcRoot by the pool, while the remote albums are enumerated. */
+static indexTask *prefetchLocalAlbum(const char *lcRoot, const char *name) {
+    indexTask *it = calloc(1, sizeof(indexTask) + strlen(lcRoot) + strlen(name) + 2);
+    if (!it)  return NULL;
+    stpcpy(stpcpy(stpcpy(it->path, lcRoot), "/"), name);
+    it->task.run = runIndexTask;
+    poolSubmit(&it->task);
+    return it;
+}
+
+/* Take the listing of the prefetched local album into *list, or index it now, and free the task. */
+static int takeLocalAlbum(indexTask *it, const char *path, dirListing *list) {
+    int errors;
+    if (!it)  return indexLocalDir(path, list);
+    poolWait(&it->task);
+    *list = it->list;
+    errors = it->errors;
+    free(it);
+    return errors;
+}
+
+/* Returns the depth of album below its root, 0 for the unfiled album. */
+static int albumDepth(const albumSnapshot *album) {
+    int depth = album->name != NULL;
+    for (const char *c = album->name; c && (c = strchr(c, '/')); c++)  depth++;
+    return depth;
+}
+
+/*
+ * Add the sub dirs of album parent of the snapshot as albums, taking their listings.
+ * Remote albums are listed with their local counterparts, local-only albums only if to restore.
+ * Albums, which were completed by an unfinished sync, are only kept for the search of their sub albums.
+ */
+static void snapshotSubAlbums(rootSnapshot *snap, const int parent) {
+    const int volRef = snap->volRef, depth = albumDepth(snap->albums + parent) + 1;
+    const char *parentName = snap->albums[parent].name, *rmParent = snap->albums[parent].rmPath, *lcParent = snap->albums[parent].lcPath;
+    const dirListing rmAlbums = snap->albums[parent].rmList, lcAlbums = snap->albums[parent].lcList; // as albums may move by realloc()
+    nameIndex remoteNames, localNames;
+    nameIndexBuild(&remoteNames, &rmAlbums);
+    nameIndexBuild(&localNames, &lcAlbums);
+    indexTask *prefetched[lcAlbums.count + 1]; // by the position in lcAlbums
+    for (int i = 0; i < lcAlbums.count; i++) {
+        const char *name = lcAlbums.items[i].name;
+        prefetched[i] = NULL;
+        if (lcAlbums.items[i].attr & vfsFileAttrDirectory && (ctx->syncThumbnailDir || strcmp(name, "#Thumbnail"))
+                && (parentName || strcmp(name, ADDITIONAL_FILES + 1)) && (ctx->doRestore || !cmpRemote(&remoteNames, name)))
+            prefetched[i] = prefetchLocalAlbum(lcParent, name);
+    }
+
+    logDebug("%s:   Now search for %d remote albums on Volume %d in '%s' ...\n", MYNAME, rmAlbums.count, volRef, rmParent);
+    for (int i = 0; i < rmAlbums.count; i++) {
+        const char *name = rmAlbums.items[i].name;
+        char rmAlbum[strlen(rmParent) + strlen(name) + 2], path[(parentName ? strlen(parentName) + 1 : 0) + strlen(name) + 1];
+        const dirItem *local;
+        albumSnapshot *album;
+        FileRef albumRef;
+        int done = 0;
+        stpcpy(stpcpy(stpcpy(rmAlbum, rmParent), "/"), name);
+        logDebug("%s:    Found remote album candidate '%s' in '%s'; attributes=%lx\n", MYNAME, name, rmParent, rmAlbums.items[i].attr);
+        if (!(rmAlbums.items[i].attr & vfsFileAttrDirectory)
+                || !(ctx->syncThumbnailDir || strcmp(name, "#Thumbnail")) // Treo 650 has #Thumbnail dir that is not an album
+                || !cmpExcludeDirList(volRef, rmAlbum))
+            continue;
+        local = nameIndexFind(&localNames, name);
+        if (ctx->journal.count && local) {
+            char lcAlbum[strlen(lcParent) + strlen(name) + 2];
+            stpcpy(stpcpy(stpcpy(lcAlbum, lcParent), "/"), name);
+            if ((done = journalAlbumDone(volRef, rmAlbum, lcAlbum)) && depth >= ctx->albumDepth)  continue;
+        }
+        stpcpy(parentName ? stpcpy(stpcpy(path, parentName), "/") : path, name);
+        if (!(album = addAlbumSnapshot(snap, path, 1, local && local->attr & vfsFileAttrDirectory))) {
+            snap->errors++;
+            break;
+        }
+        if (piErrLog(dlp_VFSFileOpen(ctx->sd, volRef, album->rmPath, vfsModeRead, &albumRef),
+                L_FATAL, volRef, album->rmPath, "   ", ": Could not open dir", "") < 0) {
+            album->failed = 1;
+            snap->errors++;
+            continue;
+        }
+        if (enumerateOpenDir(volRef, albumRef, album->rmPath, &album->rmList) >= 0)
+            album->listed = 1;
+        else if (album->rmList.count) {
+            album->failed = 1; // only partly listed, so don't restore the unlisted files
+            snap->errors++;
+        }
+        dlp_VFSFileClose(ctx->sd, albumRef);
+        if (album->onLocal && takeLocalAlbum(prefetched[local - lcAlbums.items], album->lcPath, &album->lcList))
+            snap->errors++;
+        if (album->onLocal)
+            prefetched[local - lcAlbums.items] = NULL;
+        if (done)
+            album->onRemote = album->onLocal = 0; // don't sync its files, but keep the listings for the sub albums
+    }
+
+    // To prevent from back-storing renamed albums, only the remotely unknown local albums are restored.
+    logDebug("%s:   Now search for local albums in '%s' ...\n", MYNAME, lcParent);
+    for (int i = 0; i < lcAlbums.count; i++) {
+        const char *name = lcAlbums.items[i].name;
+        char rmAlbum[strlen(rmParent) + strlen(name) + 2], path[(parentName ? strlen(parentName) + 1 : 0) + strlen(name) + 1];
+        albumSnapshot *album;
+        stpcpy(stpcpy(stpcpy(rmAlbum, rmParent), "/"), name);
+        logDebug("%s:    Found local album candidate '%s' in '%s'; attributes=%lx\n", MYNAME, name, lcParent + strlen(ctx->mediaHome) + 1, lcAlbums.items[i].attr);
+        if (!(lcAlbums.items[i].attr & vfsFileAttrDirectory) // symlinks are already followed by the index
+                || !(ctx->syncThumbnailDir || strcmp(name, "#Thumbnail")) // Treo 650 has #Thumbnail dir that is not an album
+                || (!parentName && !strcmp(name, ADDITIONAL_FILES + 1))
+                || !cmpRemote(&remoteNames, name)
+                || !cmpExcludeDirList(volRef, rmAlbum))
+            continue;
+        stpcpy(parentName ? stpcpy(stpcpy(path, parentName), "/") : path, name);
+        if (!(album = addAlbumSnapshot(snap, path, 0, 1))) {
+            snap->errors++;
+            break;
+        }
+        if (ctx->doRestore && takeLocalAlbum(prefetched[i], album->lcPath, &album->lcList))
+            snap->errors++;
+        prefetched[i] = NULL;
+    }
+    for (int i = 0; i < lcAlbums.count; i++) { // the excluded or already synced ones
+        dirListing unused = {0};
+        if (prefetched[i])  takeLocalAlbum(prefetched[i], NULL, &unused);
+        dirListingFree(&unused);
+    }
+    nameIndexFree(&remoteNames);
+    nameIndexFree(&localNames);
+}
+
+/*
+ * Take the snapshot of the unfiled album and the albums in remote root dirRef and local root lcRoot, down to the
+ * depth of pref albumDepth. The albums are searched breadth first, where the albums array of the snapshot serves as
+ * queue of the dirs still to search, so no listing is held on the call stack, and the local sub dirs of one dir are
+ * indexed by the pool, while its remote sub dirs are enumerated.
+ * Returns 0, or -3, if the remote root could not be enumerated, but the snapshot is taken anyway.
+ */
+PI_ERR snapshotRoot(rootSnapshot *snap, const int volRef, const FileRef dirRef, const char *rmRoot, const char *lcRoot) {
+    PI_ERR result = 0;
+    albumSnapshot *unfiled;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->volRef = volRef;
+    if (!(snap->rmRoot = strdup(rmRoot)) || !(snap->lcRoot = strdup(lcRoot)) || !(unfiled = addAlbumSnapshot(snap, NULL, 1, 1))) {
+        snap->errors++;
+        return 0;
+    }
+    // Fetch the unfiled album, which is simply the root dir. Apparently the Treo 650 can store media in the root dir,
+    // as well as in album dirs. So its listings also serve the search for albums.
+    if (enumerateOpenDir(volRef, dirRef, rmRoot, &unfiled->rmList) < 0) {
+        // Crashes on empty directory (see: <https://github.com/juddmon/jpilot/issues/??>):
+        // For workaround and additional bug on SDCard volume, see at enumerateOpenDir()
+        result = -3;
+    } else
+        unfiled->listed = 1;
+    int errors = ctx->dryRun && access(lcRoot, F_OK) ? 0 : indexLocalDir(lcRoot, &unfiled->lcList); // not created by a dry run
+    if (errors) {
+        snap->errors++;
+        if (errors < 0)  return result;
+    }
+    if (journalAlbumDone(volRef, rmRoot, lcRoot)) // don't sync the unfiled files,
+        unfiled->onRemote = unfiled->onLocal = 0; // but keep the listings for the albums
+    for (int parent = 0; parent < snap->count; parent++) {
+        if (!snap->albums[parent].failed && albumDepth(snap->albums + parent) < ctx->albumDepth)
+            snapshotSubAlbums(snap, parent);
+    }
+    return result;
+}
+
+static int addPlanItem(syncPlan *plan, const int op, albumSnapshot *album, const char *name, const long size, const time_t date) {
+    if (plan->count >= plan->allocated) {
+        int allocated = plan->allocated ? plan->allocated * 2 : DIR_BATCH;
+        planItem *items = realloc(plan->items, allocated * sizeof(*items));
+        if (!items)  return EXIT_FAILURE;
+        plan->items = items;
+        plan->allocated = allocated;
+    }
+    plan->items[plan->count] = (planItem){op, album, NULL, name, size, date, plan->count};
+    plan->count++;
+    plan->counts[op]++;
+    if (size >= 0)
+        plan->bytes[op] += size;
+    else if (op == OP_BACKUP || op == OP_RESTORE)
+        plan->unknownSizes++;
+    return EXIT_SUCCESS;
+}
+
+/* Returns 1, if the remote listing of album contains file, otherwise 0. */
+static int remoteListed(const albumSnapshot *album, const char *file) {
+    for (int i = 0; i < album->rmList.count; i++) {
+        if (!strcmp(file, album->rmList.items[i].name))  return 1;
+    }
+    return 0;
+}
+
+/*
+ * Files moved between albums on the Palm would be fetched again in full, and even be restored back to their old album.
+ * So the backups of files, which are missing in their local album, but were synced under the same name from another
+ * album of the root before according to the manifest, are turned into a move of the local copy, which drops its
+ * restore, or into a link, if the file is still in the old remote album. The executor verifies size and date,
+ * before it touches anything.
+ */
+static void detectMoves(rootSnapshot *snap, syncPlan *plan) {
+    typedef struct {int album, item;} localFile;
+    localFile *slots;
+    nameIndex *remoteNames; // of the source albums, built on first use
+    int *restores; // plan items of the restores, hashed by album and name
+    unsigned size = 16, mask, restoreSize = 16, restoreMask;
+    int files = 0, dropped = 0;
+
+    for (int a = 0; a < snap->count; a++)
+        files += snap->albums[a].lcList.count;
+    if (!plan->counts[OP_BACKUP] || !ctx->manifest.count || !files)  return;
+    while (size < 2 * (unsigned)files)  size *= 2; // keep load factor <= 0.5
+    while (restoreSize < 2 * (unsigned)plan->counts[OP_RESTORE])  restoreSize *= 2;
+    slots = malloc(size * sizeof(*slots));
+    restores = malloc(restoreSize * sizeof(*restores));
+    if (!slots || !restores || !(remoteNames = calloc(snap->count, sizeof(*remoteNames)))) { // then just backup
+        free(slots);
+        free(restores);
+        return;
+    }
+    mask = size - 1;
+    restoreMask = restoreSize - 1;
+    memset(slots, -1, size * sizeof(*slots));
+    memset(restores, -1, restoreSize * sizeof(*restores));
+    for (int p = 0; p < plan->count; p++) {
+        if (plan->items[p].op != OP_RESTORE)  continue;
+        unsigned slot = (hashName(plan->items[p].name) ^ (unsigned)(plan->items[p].album - snap->albums)) & restoreMask;
+        while (restores[slot] >= 0)  slot = (slot + 1) & restoreMask;
+        restores[slot] = p;
+    }
+    for (int a = 0; a < snap->count; a++) { // index the local files of all albums by name
+        for (int i = 0; !snap->albums[a].failed && i < snap->albums[a].lcList.count; i++) {
+            unsigned slot = hashName(snap->albums[a].lcList.items[i].name) & mask;
+            while (slots[slot].album >= 0)  slot = (slot + 1) & mask;
+            slots[slot] = (localFile){a, i};
         }
-        if (writesize < 0) {
-            jp_logf(L_FATAL, "\n%s:       %s on file write, aborting at %d bytes left.\n",
-                    MYNAME, errString(fileRef, writesize, L_FATAL, ""), remaining - offset);
-            return writesize;
+    }
+    for (int p = 0; p < plan->count; p++) {
+        planItem *item = plan->items + p;
+        albumSnapshot *source = NULL;
+        int here = 0;
+        if (item->op != OP_BACKUP)  continue;
+        for (unsigned slot = hashName(item->name) & mask; !here && slots[slot].album >= 0; slot = (slot + 1) & mask) {
+            albumSnapshot *album = snap->albums + slots[slot].album;
+            const dirItem *local = album->lcList.items + slots[slot].item;
+            char key[strlen(album->rmPath) + strlen(item->name) + 14];
+            if (local->attr & vfsFileAttrDirectory || strcmp(item->name, local->name))  continue;
+            snprintf(key, sizeof(key), "%d:%s/%s", snap->volRef, album->rmPath, item->name);
+            if (album == item->album)
+                here = 1;
+            else if (!source && manifestLookup(key))
+                source = album;
+        }
+        if (here || !source)  continue;
+        nameIndex *sourceNames = remoteNames + (source - snap->albums);
+        if (!sourceNames->list)
+            nameIndexBuild(sourceNames, &source->rmList);
+        plan->counts[item->op]--;
+        plan->unknownSizes -= item->size < 0;
+        item->op = nameIndexFind(sourceNames, item->name) ? OP_LINK_LOCAL : OP_MOVE_LOCAL;
+        item->source = source;
+        plan->counts[item->op]++;
+        for (unsigned slot = (hashName(item->name) ^ (unsigned)(source - snap->albums)) & restoreMask;
+                item->op == OP_MOVE_LOCAL && restores[slot] >= 0; slot = (slot + 1) & restoreMask) {
+            planItem *restore = plan->items + restores[slot];
+            if (restore->op == OP_RESTORE && restore->album == source && !strcmp(restore->name, item->name)) {
+                plan->counts[OP_RESTORE]--;
+                plan->bytes[OP_RESTORE] -= MAX(restore->size, 0);
+                restore->op = PLAN_OPS; // drop it below
+                dropped++;
+                break;
+            }
         }
     }
-    return (int)buf->used;
+    for (int p = 0, q = 0; dropped && p < plan->count; p++) {
+        if (plan->items[p].op != PLAN_OPS)
+            plan->items[q++] = plan->items[p];
+        if (p == plan->count - 1)
+            plan->count = q;
+    }
+    for (int a = 0; a < snap->count; a++)
+        nameIndexFree(remoteNames + a);
+    free(remoteNames);
+    free(restores);
+    free(slots);
 }
 
-int fileCompare(FileRef fileRef, FILE *fileP, int filesize) {
-    int result;
-    for (int todo = filesize; todo > 0; todo -= piBuf->used) {
-        if (fileRead(fileRef, NULL, piBuf, todo) < 0 || fileRead(0, fileP, piBuf2, todo) < 0 || piBuf->used != piBuf2->used) {
-            jp_logf(L_FATAL, "%s:       ERROR reading files for comparison, so assuming different ...\n", MYNAME);
-            jp_logf(L_DEBUG, "%s:       filesize=%d, todo=%d, piBuf->used=%d, piBuf2->used=%d\n", MYNAME, filesize, todo, piBuf->used, piBuf2->used);
-            result = -1; // remember error
-            break;
+/*
+ * Derive the ordered plan of operations from the snapshot, so each album is synced at once: First its dir is created
+ * on the missing side, then the local files unknown on the Palm are restored, so renamed files are not stored back,
+ * then the remote files, which are not known to be in sync by the manifest, are backuped and at last the local album
+ * date is set from the Palm. Doesn't do any I/O, so it only depends on the snapshot, the prefs, the manifest and the journal.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE, if out of memory.
+ */
+int diffSnapshot(rootSnapshot *snap, syncPlan *plan) {
+    int result = EXIT_SUCCESS;
+    memset(plan, 0, sizeof(*plan));
+    for (int a = 0; a < snap->count && result == EXIT_SUCCESS; a++) {
+        albumSnapshot *album = snap->albums + a;
+        nameIndex remoteNames, localNames;
+        if (album->failed || (!album->onRemote && !album->onLocal))  continue;
+        if (!album->onLocal)
+            result |= addPlanItem(plan, OP_MKDIR_LOCAL, album, album->name, -1, 0);
+        if (!album->onRemote)
+            result |= addPlanItem(plan, OP_MKDIR_REMOTE, album, album->name, -1, 0);
+        nameIndexBuild(&remoteNames, &album->rmList);
+        nameIndexBuild(&localNames, &album->lcList);
+        if (ctx->useManifest && !ctx->dryRun && album->listed && album->onRemote && !album->failed)
+            manifestListed(snap->volRef, album->rmPath, &remoteNames);
+        for (int i = 0; ctx->doRestore && i < album->lcList.count; i++) {
+            const dirItem *item = album->lcList.items + i;
+            if (!(item->attr & vfsFileAttrDirectory)
+                    && strlen(item->name) > 2
+                    && casecmpFileTypeList(item->name) > 0
+                    && cmpRemote(&remoteNames, item->name)
+                    && !journalFileDone(snap->volRef, album->rmPath, item->name))
+                result |= addPlanItem(plan, OP_RESTORE, album, item->name, item->size, item->date);
         }
-        if ((result = memcmp(piBuf->data, piBuf2->data, piBuf->used))) {
-            break; // Files have different content.
+        for (int i = 0; ctx->doBackup && i < album->rmList.count; i++) {
+            const dirItem *item = album->rmList.items + i, *local;
+            char key[strlen(album->rmPath) + strlen(item->name) + 14];
+            const manifestEntry *known;
+            // Grab only regular files, but ignore the 'read only' and 'archived' bits, and only with known extensions.
+            if (item->attr & (vfsFileAttrHidden | vfsFileAttrSystem | vfsFileAttrVolumeLabel | vfsFileAttrDirectory | vfsFileAttrLink)
+                    || strlen(item->name) <= 1
+                    || casecmpFileTypeList(item->name) < 0)
+                continue;
+            snprintf(key, sizeof(key), "%d:%s/%s", snap->volRef, album->rmPath, item->name);
+            if (ctx->useManifest && !ctx->compareContent && (local = nameIndexFind(&localNames, item->name)) && (known = manifestLookup(key))
+                    && local->size == known->size && local->date == known->lcDate
+                    && manifestRemoteMatch(known, snap->volRef, strchr(key, ':') + 1, item))
+                continue; // unchanged on both sides since last sync
+            if (journalFileDone(snap->volRef, album->rmPath, item->name))
+                continue;
+            result |= addPlanItem(plan, OP_BACKUP, album, item->name, item->size, 0);
         }
+        if (ctx->doBackup && album->onRemote && album->name) // the root date is set after all albums
+            result |= addPlanItem(plan, OP_DATE_LOCAL, album, album->name, -1, 0);
+        nameIndexFree(&remoteNames);
+        nameIndexFree(&localNames);
     }
+    if (result == EXIT_SUCCESS && ctx->doBackup && ctx->useManifest)
+        detectMoves(snap, plan);
+    if (result != EXIT_SUCCESS)
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
     return result;
 }
 
-int casecmpFileTypeList(const char *fname) {
-    char *ext = strrchr(fname, '.');
-    for (fullPath *item = fileTypeList; ext && item; item = item->next) {
-        if (*(item->name) != '-') {
-            if (!strcasecmp(ext + 1, item->name))  return 1; // backup & restore
-        } else {
-            if (!strcasecmp(ext + 1, item->name + 1))  return 0; // only backup
-        }
+void freePlan(syncPlan *plan) {
+    free(plan->items);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/* Estimate the duration of the plan from the DLP latency and throughput measured so far, which is learned per volume. */
+double estimatePlan(const syncPlan *plan, const int volRef) {
+    long calls = 0;
+    double dlpSecs = 0, secs = 0;
+    for (int type = 0; type < CALL_STAT; type++) {
+        calls += ctx->callStatsTable[type].calls;
+        dlpSecs += ctx->callStatsTable[type].secs;
     }
-    return -1; // no match, no sync
+    double callSecs = calls ? dlpSecs / calls : EST_CALL_SECS;
+    selectChunkTuners(volRef);
+    double readRate = ctx->readTuner && ctx->readTuner->rates[bestChunkSize(ctx->readTuner)] ? ctx->readTuner->rates[bestChunkSize(ctx->readTuner)] : EST_BYTES_PER_SEC;
+    double writeRate = ctx->writeTuner && ctx->writeTuner->rates[bestChunkSize(ctx->writeTuner)] ? ctx->writeTuner->rates[bestChunkSize(ctx->writeTuner)] : EST_BYTES_PER_SEC;
+    for (int op = 0; op < PLAN_OPS; op++)
+        secs += plan->counts[op] * PLAN_OP_CALLS[op] * callSecs;
+    return secs + plan->bytes[OP_BACKUP] / readRate + plan->bytes[OP_RESTORE] / writeRate;
 }
 
-int cmpRemote(VFSDirInfo dirInfos[], int dirItems, const char *fname) {
-    int result = 1;
-    for (int i=0; i<dirItems; i++) {
-        if (!(result = strcmp(fname, dirInfos[i].name)))  break;
+/* Log the plan, with level L_INFO in dry run, otherwise L_DEBUG. */
+void logPlan(const rootSnapshot *snap, const syncPlan *plan) {
+    int level = ctx->dryRun ? L_INFO : L_DEBUG;
+    for (int i = 0; ctx->dryRun && i < plan->count; i++) {
+        const planItem *item = plan->items + i;
+        if (item->op == OP_BACKUP || item->op == OP_RESTORE)
+            jp_logf(level, "%s:    Would %s '%s/%s', size %ld\n", MYNAME, PLAN_OP_NAMES[item->op], item->album->rmPath, item->name, item->size);
+        else if (item->op == OP_MOVE_LOCAL || item->op == OP_LINK_LOCAL)
+            jp_logf(level, "%s:    Would %s '%s/%s' to '%s'\n", MYNAME, PLAN_OP_NAMES[item->op], item->source->lcPath, item->name, item->album->lcPath);
+        else if (item->op != OP_DATE_LOCAL)
+            jp_logf(level, "%s:    Would %s '%s'\n", MYNAME, PLAN_OP_NAMES[item->op], item->op == OP_MKDIR_LOCAL ? item->album->lcPath : item->album->rmPath);
     }
-    return result;
+    jp_logf(level, "%s:   Plan for '%s' on volume %d: %d albums, %d local and %d remote dirs to create, %d files (%lld bytes) to restore,"
+            " %d files (%lld bytes) to backup, %d of unknown size, estimated %.1f s\n", MYNAME, snap->rmRoot, snap->volRef,
+            snap->count, plan->counts[OP_MKDIR_LOCAL], plan->counts[OP_MKDIR_REMOTE], plan->counts[OP_RESTORE], plan->bytes[OP_RESTORE],
+            plan->counts[OP_BACKUP], plan->bytes[OP_BACKUP], plan->unknownSizes, estimatePlan(plan, snap->volRef));
 }
 
 /*
- * Backup a file from the Palm device, if not existent or different.
+ * The Media app indexes each album dir in file ALBUM_DB (see: "Album.db stucture.txt"), which it otherwise rebuilds
+ * on the device. So after restoring into an album, its existing Album.db is updated in one transfer.
+ * Data is big endian: a header of ALBUM_DB_HEADER bytes, which is kept as is, followed by records
+ * of ALBUM_DB_RECORD bytes with the file name, thumbnail number, created and modified date and file size.
  */
-int backupFileIfNeeded(const unsigned volRef, const char *rmDir, const char *lcDir, const char *file) {
-    jp_logf(L_DEBUG, "%s:      backupFileIfNeeded(volRef=%d, rmDir='%s', lcDir='%s', file='%s')\n", MYNAME, volRef, rmDir, lcDir, file);
-    char rmPath[strlen(rmDir) + strlen(file) + 2];
-    char lcPath[strlen(lcDir) + strlen(file) + 4]; // prepare for possible rename
-    FileRef fileRef;
-    FILE *fileP;
-    int filesize; // also serves as error return code
+#define ALBUM_DB "Album.db"
+#define ALBUM_DB_HEADER 16
+#define ALBUM_DB_RECORD 352
+#define ALBUM_DB_NAME 0x100 // max. size of the name
+#define ALBUM_DB_THUMBNAIL 0x100
+#define ALBUM_DB_CREATED 0x104
+#define ALBUM_DB_MODIFIED 0x108
+#define ALBUM_DB_SIZE 0x10C
+#define PALM_EPOCH 2082844800 // seconds from 1904-01-01 to 1970-01-01
+
+static uint32_t getBE32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
 
-    stpcpy(stpcpy(stpcpy(rmPath, rmDir), "/"), file);
-    stpcpy(stpcpy(stpcpy(lcPath, lcDir), "/"), file);
+static void setBE32(unsigned char *p, const uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
 
-    if (piErrLog(dlp_VFSFileOpen(sd, volRef, rmPath, vfsModeRead, &fileRef),
-            L_FATAL, volRef, rmPath, "      ", ": Could not open remote file","") < 0)
-        return -1;
-    else if (piErrLog(dlp_VFSFileSize(sd, fileRef, &filesize),
-            L_WARN, volRef, rmPath, "      ", ": Could not get size of", ", so anyway backup it.") < 0)
-        filesize = 0;
+/* Returns 1, if fname is shown as an item in the Media app, so not i.e. an audio caption 'photo.jpg.amr'. */
+static int albumDbItem(const char *fname) {
+    char base[strlen(fname) + 1], *ext;
+    strcpy(base, fname);
+    if (strlen(fname) >= ALBUM_DB_NAME || !(ext = strrchr(base, '.')))  return 0;
+    *ext = '\0';
+    return casecmpFileTypeList(base) < 0;
+}
 
-    struct stat fstat;
-    int statErr = stat(lcPath, &fstat);
-    if (!statErr) {
-        int equal = 0;
-        if (fstat.st_size != filesize) {
-            jp_logf(L_WARN, "%s:       WARNING: File '%s' already exists, but has different size %d vs. %d,\n", MYNAME, lcPath, fstat.st_size, filesize);
-        } else if (!compareContent) {
-            equal = 1;
-        } else {
-            FILE *fileP;
-            if (!(fileP = fopen(lcPath, "r"))) {
-                jp_logf(L_WARN, "%s:       WARNING: Cannot open %s for comparing %d bytes, so may have different content,\n", MYNAME, lcPath, filesize);
-            } else {
-                if (!(equal = !fileCompare(fileRef, fileP, filesize)))
-                    jp_logf(L_WARN, "%s:       WARNING: File '%s' already exists, but has different content,\n", MYNAME, lcPath);
-                fclose(fileP);
-                if (piErrLog(dlp_VFSFileSeek(sd, fileRef, vfsOriginBeginning, 0),
-                        L_FATAL, volRef, file, "      ", ": Could not rewind file", ", so can not copy it, aborting ...") < 0) {
-                    filesize = -1; // remember error
-                    goto Exit;
-                }
-            }
+/* Read the remote file at rmPath in one transfer. Returns the new buffer, or NULL, if not existent or on error. */
+pi_buffer_t *readRemoteFile(const int volRef, const char *rmPath) {
+    pi_buffer_t *buf = NULL;
+    FileRef fileRef;
+    int size;
+    if (dlp_VFSFileOpen(ctx->sd, volRef, rmPath, vfsModeRead, &fileRef) < 0)  return NULL;
+    selectChunkTuners(volRef);
+    if (dlp_VFSFileSize(ctx->sd, fileRef, &size) >= 0 && (buf = pi_buffer_new(MAX(size, 1)))) {
+        for (int readsize; buf && (int)buf->used < size; ) {
+            if ((readsize = fileRead(fileRef, NULL, ctx->piBuf, size - buf->used)) <= 0) {
+                pi_buffer_free(buf);
+                buf = NULL;
+            } else
+                pi_buffer_append(buf, ctx->piBuf->data, readsize);
         }
-        if (equal) {
-            jp_logf(L_DEBUG, "%s:       File '%s' already exists, not copying it.\n", MYNAME, lcPath);
-            goto Exit;
+    }
+    dlp_VFSFileClose(ctx->sd, fileRef);
+    return buf;
+}
+
+/* Write buf to the remote file at rmPath in one transfer via a part file, replacing an existing file. */
+PI_ERR writeRemoteFile(const int volRef, const char *rmPath, pi_buffer_t *buf) {
+    char rmPart[strlen(rmPath) + sizeof(PART_SUFFIX)];
+    FileRef fileRef;
+    PI_ERR piErr;
+    strcat(strcpy(rmPart, rmPath), PART_SUFFIX);
+    dlp_VFSFileDelete(ctx->sd, volRef, rmPart); // stale from an interrupted sync
+    if ((piErr = piErrLog(dlp_VFSFileOpen(ctx->sd, volRef, rmPart, vfsModeReadWrite | vfsModeCreate, &fileRef),
+            L_FATAL, volRef, rmPart, "      ", ": Could not open remote file", " for writing.")) < 0)
+        return piErr;
+    selectChunkTuners(volRef);
+    piErr = fileWrite(fileRef, NULL, buf, buf->used) < 0 ? -1 : 0;
+    dlp_VFSFileClose(ctx->sd, fileRef);
+    metaInvalidate(volRef, rmPart, META_EXISTS | META_DATE | META_ATTR | META_SIZE);
+    metaInvalidate(volRef, rmPath, META_EXISTS | META_DATE | META_ATTR | META_SIZE);
+    if (piErr >= 0) {
+        dlp_VFSFileDelete(ctx->sd, volRef, rmPath);
+        piErr = piErrLog(dlp_VFSFileRename(ctx->sd, volRef, rmPart, strrchr(rmPath, '/') + 1),
+                L_FATAL, volRef, rmPart, "      ", ": Could not rename remote file", "");
+    }
+    if (piErr < 0)
+        dlp_VFSFileDelete(ctx->sd, volRef, rmPart);
+    return piErr;
+}
+
+/*
+ * Update the existing Album.db of album with the files restored into it by the plan. Without an Album.db, i.e. in an
+ * album created by the sync, it is left to the Media app to build it, as its header is not known.
+ */
+PI_ERR updateAlbumDb(const int volRef, albumSnapshot *album, const syncPlan *plan) {
+    char rmPath[strlen(album->rmPath) + sizeof(ALBUM_DB) + 1];
+    pi_buffer_t *db = NULL;
+    PI_ERR piErr = 0;
+    int added = 0, updated = 0;
+
+    stpcpy(stpcpy(stpcpy(rmPath, album->rmPath), "/"), ALBUM_DB);
+    if (remoteListed(album, ALBUM_DB) && (db = readRemoteFile(volRef, rmPath))
+            && (db->used < ALBUM_DB_HEADER || (db->used - ALBUM_DB_HEADER) % ALBUM_DB_RECORD)) {
+        jp_logf(L_WARN, "%s:     WARNING: Unknown format of '%s' on volume %d, so leaving it to the Media app.\n", MYNAME, rmPath, volRef);
+        pi_buffer_free(db);
+        return 0;
+    }
+    if (!db)  return 0;
+    for (int i = 0; i < plan->count; i++) {
+        const planItem *item = plan->items + i;
+        unsigned char record[ALBUM_DB_RECORD] = {0}, *recordP = NULL;
+        if (item->album != album || item->op != OP_RESTORE || !item->done || !albumDbItem(item->name))  continue;
+        for (size_t offset = ALBUM_DB_HEADER; !recordP && offset < db->used; offset += ALBUM_DB_RECORD) {
+            if (!strncmp((char *)db->data + offset, item->name, ALBUM_DB_NAME))  recordP = db->data + offset;
         }
-        // Find alternative destination file name, which not alredy exists, by inserting a number.
-        char *i = lcPath + strlen(lcPath), *insert = strrchr(lcPath, '.');
-        insert = insert ? insert : i; // correct if there was no '.'
-        for (; i >= insert; i--)  *(i + 2) = *i;
-        *insert++ = '_';  *insert = '1';
-        for (; !stat(lcPath, &fstat); (*insert)++) {; // increment number by 1
-            if (*insert >= '9') {
-                jp_logf(L_WARN, "%s:               and even file '%s' already exists, so no new backup for '%s'.\n", MYNAME, lcPath, file);
-                filesize = -1; // remember error
-                goto Exit;
-            }
+        if (recordP)
+            updated++;
+        else {
+            strcpy((char *)record, item->name);
+            if (!pi_buffer_append(db, record, sizeof(record)))  break;
+            recordP = db->data + db->used - ALBUM_DB_RECORD;
+            added++;
         }
-        jp_logf(L_WARN, "%s:               so backup to '%s'.\n", MYNAME, lcPath);
+        time_t date = item->date;
+        if (!date) {
+            char lcPath[strlen(album->lcPath) + strlen(item->name) + 2];
+            date = getLocalDate(strcat(strcat(strcpy(lcPath, album->lcPath), "/"), item->name));
+        }
+        setBE32(recordP + ALBUM_DB_CREATED, date + PALM_EPOCH); // the dates as set by restoreFile()
+        setBE32(recordP + ALBUM_DB_MODIFIED, date + PALM_EPOCH);
+        setBE32(recordP + ALBUM_DB_SIZE, item->size);
     }
-    // File has not already been synced, backup it.
-    if (!(fileP = fopen(lcPath, "wx"))) {
-        jp_logf(L_FATAL, "%s:       ERROR: Cannot open %s for writing %d bytes!\n", MYNAME, lcPath, filesize);
-        filesize = -1; // remember error
-        goto Exit;
+    if ((added || updated) && (piErr = writeRemoteFile(volRef, rmPath, db)) >= 0)
+        jp_logf(L_INFO, "%s:     Wrote '%s' with %d added and %d updated items on volume %d\n", MYNAME, rmPath, added, updated, volRef);
+    pi_buffer_free(db);
+    return piErr;
+}
+
+/*
+ * Serve the sizes and dates of the files in album from its ALBUM_DB via the metadata cache, so backupFileIfNeeded()
+ * and resolvePlan() don't need to ask the Palm for each file. Only records of listed files with a size and date are
+ * taken; one, which differs from the file, is dropped by backupFileIfNeeded(). The index is read in one transfer,
+ * if the round trips it saves for the backups from the album are expected to outweigh the transfer.
+ */
+void loadAlbumIndex(const int volRef, albumSnapshot *album, const syncPlan *plan) {
+    char rmPath[strlen(album->rmPath) + sizeof(ALBUM_DB) + 1];
+    pi_buffer_t *db;
+    int backups = 0, indexed = 0;
+
+    if (album->indexed || !album->name || !remoteListed(album, ALBUM_DB))  return;
+    album->indexed = 1;
+    for (int i = 0; i < plan->count; i++)
+        backups += plan->items[i].album == album && plan->items[i].op == OP_BACKUP;
+    if (backups * 2 * EST_CALL_SECS < album->rmList.count * ALBUM_DB_RECORD / EST_BYTES_PER_SEC)  return;
+    stpcpy(stpcpy(stpcpy(rmPath, album->rmPath), "/"), ALBUM_DB);
+    if (!(db = readRemoteFile(volRef, rmPath)))  return;
+    if (db->used >= ALBUM_DB_HEADER && !((db->used - ALBUM_DB_HEADER) % ALBUM_DB_RECORD)) {
+        nameIndex remoteNames;
+        nameIndexBuild(&remoteNames, &album->rmList);
+        for (size_t offset = ALBUM_DB_HEADER; offset < db->used; offset += ALBUM_DB_RECORD) {
+            const char *name = (char *)db->data + offset;
+            const dirItem *listed;
+            long size = getBE32(db->data + offset + ALBUM_DB_SIZE);
+            time_t date = getBE32(db->data + offset + (ctx->useDateModified ? ALBUM_DB_MODIFIED : ALBUM_DB_CREATED));
+            if (!memchr(name, '\0', ALBUM_DB_NAME) || !(listed = nameIndexFind(&remoteNames, name))
+                    || listed->attr & vfsFileAttrDirectory || size <= 0 || date <= PALM_EPOCH)
+                continue;
+            char path[strlen(album->rmPath) + strlen(name) + 2];
+            stpcpy(stpcpy(stpcpy(path, album->rmPath), "/"), name);
+            metaPut(volRef, path, META_DATE | META_SIZE, date - PALM_EPOCH, 0, size);
+            indexed++;
+        }
+        nameIndexFree(&remoteNames);
     }
-    // Copy file.
-    jp_logf(L_INFO, "%s:      Backup '%s', size %d ...", MYNAME, rmPath, filesize);
-    for (int remaining = filesize; remaining > 0; remaining -= piBuf->used) {
-        if (fileRead(fileRef, NULL, piBuf, remaining) < 0)  {
-            filesize = -1; // remember error
-            break;
+    logDebug("%s:     Indexed %d of %d listed files from '%s' on volume %d\n", MYNAME, indexed, album->rmList.count, rmPath, volRef);
+    pi_buffer_free(db);
+}
+
+/*
+ * Get the unknown sizes, and if needDates, the dates of the files to backup from the Palm, as the remote listings
+ * don't tell them, so the plan can be ordered and tells the bytes to transfer. The dates go to the metadata cache,
+ * so the later backups don't ask for them again.
+ */
+void resolvePlan(const rootSnapshot *snap, syncPlan *plan, const int needDates) {
+    for (int i = 0; i < plan->count; i++) {
+        planItem *item = plan->items + i;
+        if (item->op != OP_BACKUP || (item->size >= 0 && (item->date || !needDates)))  continue;
+        char rmPath[strlen(item->album->rmPath) + strlen(item->name) + 2];
+        FileRef fileRef;
+        int size;
+        remoteMeta *meta;
+        stpcpy(stpcpy(stpcpy(rmPath, item->album->rmPath), "/"), item->name);
+        loadAlbumIndex(snap->volRef, item->album, plan);
+        if ((meta = metaGet(snap->volRef, rmPath, META_SIZE | META_DATE, 4))) {
+            if (item->size < 0) {
+                plan->bytes[OP_BACKUP] += item->size = meta->size;
+                plan->unknownSizes--;
+            }
+            item->date = meta->date;
+            continue;
         }
-        if (fileWrite(0, fileP, piBuf, remaining) < 0) {
-            filesize = -1; // remember error
-            break;
+        if (dlp_VFSFileOpen(ctx->sd, snap->volRef, rmPath, vfsModeRead, &fileRef) < 0)  continue;
+        if (item->size < 0 && dlp_VFSFileSize(ctx->sd, fileRef, &size) >= 0) {
+            item->size = size;
+            plan->bytes[OP_BACKUP] += size;
+            plan->unknownSizes--;
         }
+        if (needDates)
+            item->date = getRemoteDate(fileRef, snap->volRef, rmPath, NULL);
+        dlp_VFSFileClose(ctx->sd, fileRef);
     }
-    fclose(fileP);
-    if (filesize < 0) {
-        unlink(lcPath); // remove the partially created file
-        jp_logf(L_WARN, "%s:       WARNING: Deleted incomplete local file '%s'\n", MYNAME, lcPath);
-    } else {
-        jp_logf(L_INFO, " OK\n");
-        // Get the date on that the picture was created.
-        time_t date = getRemoteDate(fileRef, volRef, rmPath, NULL);
-        if (date)  setLocalDate(lcPath, date);
-    }
-Exit:
-    dlp_VFSFileClose(sd, fileRef);
-    jp_logf(L_DEBUG, "%s:       Backup file size / copy result: %d, statErr=%d\n", MYNAME, filesize, statErr);
-    return filesize;
 }
 
 /*
- * Restore a file to the remote Palm device.
+ * Order the transfers of the plan by pref scheduleOrder, so with a budget the most wanted files come first:
+ * 0 = as listed, 1 = smallest first, 2 = newest first, 3 = by the order of pref fileTypes.
+ * The dirs are created before and the dir dates are set after all transfers.
  */
-int restoreFile(const char *lcDir, const unsigned volRef, const char *rmDir, const char *file) {
-    jp_logf(L_DEBUG, "%s:      restoreFile(lcDir='%s', volRef=%d, rmDir='%s', file='%s')\n", MYNAME, lcDir, volRef, rmDir, file);
-    char lcPath[strlen(lcDir) + strlen(file) + 2];
-    char rmPath[strlen(rmDir) + strlen(file) + 2];
-    FILE *fileP;
-    FileRef fileRef;
-    int filesize; // also serves as error return
+enum scheduleOrders {SCHEDULE_LISTED, SCHEDULE_SMALLEST, SCHEDULE_NEWEST, SCHEDULE_FILE_TYPE};
 
-    stpcpy(stpcpy(stpcpy(lcPath, lcDir), "/"), file);
-    stpcpy(stpcpy(stpcpy(rmPath, rmDir), "/"), file);
+static int planPhase(const int op) {
+    return op == OP_MKDIR_LOCAL || op == OP_MKDIR_REMOTE ? 0 : op == OP_DATE_LOCAL ? 2 : 1;
+}
 
-    struct stat fstat;
-    int statErr;
-    if ((statErr = stat(lcPath, &fstat))) {
-        jp_logf(L_FATAL, "%s:       ERROR %d: Could not read status of %s.\n", MYNAME, statErr, lcPath);
-        return -1;
+static int cmpPlanItem(const void *a, const void *b) {
+    const planItem *itemA = a, *itemB = b;
+    long keyA = 0, keyB = 0;
+    if (ctx->scheduleOrder == SCHEDULE_SMALLEST) { // unknown sizes last
+        keyA = itemA->size < 0 ? LONG_MAX : itemA->size;
+        keyB = itemB->size < 0 ? LONG_MAX : itemB->size;
+    } else if (ctx->scheduleOrder == SCHEDULE_NEWEST) {
+        keyA = -itemA->date;
+        keyB = -itemB->date;
+    } else if (ctx->scheduleOrder == SCHEDULE_FILE_TYPE) {
+        keyA = fileTypeRank(itemA->name);
+        keyB = fileTypeRank(itemB->name);
     }
-    filesize = fstat.st_size;
-    if (!(fileP = fopen(lcPath, "r"))) {
-        jp_logf(L_FATAL, "%s:       ERROR: Could not open %s for reading %d bytes,\n", MYNAME, lcPath, filesize);
-        return -1;
+    return keyA < keyB ? -1 : keyA > keyB ? 1 : itemA->seq - itemB->seq; // keep it stable
+}
+
+int schedulePlan(syncPlan *plan) {
+    planItem *items;
+    int count = 0;
+    if (ctx->scheduleOrder == SCHEDULE_LISTED || plan->count < 2)  return EXIT_SUCCESS;
+    if (!(items = mallocLog(plan->count * sizeof(*items))))  return EXIT_FAILURE;
+    for (int phase = 0; phase < 3; phase++) {
+        int first = count;
+        for (int i = 0; i < plan->count; i++) {
+            if (planPhase(plan->items[i].op) == phase)
+                items[count++] = plan->items[i];
+        }
+        if (phase == 1)
+            qsort(items + first, count - first, sizeof(*items), cmpPlanItem);
     }
-    if (piErrLog(dlp_VFSFileOpen(sd, volRef, rmPath, vfsModeReadWrite | vfsModeCreate, &fileRef),
-            L_FATAL, volRef, rmPath, "      ", ": Could not open remote file", " for read/writing.") < 0) { // May not work on DLP,
-    //~ // ... then first create file with:
-    //~ if (piErrLog(dlp_VFSFileCreate(sd, volRef, rmPath), L_FATAL, volRef, rmPath, "      ", ": Could not create remote file","") < 0 ||
-            //~ (piErrLog(dlp_VFSFileOpen(sd, volRef, rmPath, vfsModeWrite, &fileRef), // See: https://github.com/desrod/pilot-link/issues/10
-            //~ (piErrLog(dlp_VFSFileOpen(sd, volRef, rmPath, vfsModeReadWrite, &fileRef),
-            //~ L_FATAL, volRef, rmPath, "      ", ": Could not open remote file", " for read/writing.") < 0) {
-        filesize = -1; // remember error
-        goto Exit;
+    free(plan->items);
+    plan->items = items;
+    plan->allocated = plan->count;
+    return EXIT_SUCCESS;
+}
+
+/* Returns 1, if the budget of the sync by prefs maxSyncSecs and maxSyncBytes doesn't allow the transfer of item. */
+static int overBudget(const planItem *item) {
+    long long moved = ctx->callStatsTable[CALL_FILE_READ].bytes + ctx->callStatsTable[CALL_FILE_WRITE].bytes;
+    return (ctx->maxSyncSecs > 0 && monotonicSecs() - ctx->syncStart >= ctx->maxSyncSecs)
+            || (ctx->maxSyncBytes > 0 && (moved >= ctx->maxSyncBytes || (item->size > 0 && moved + item->size > ctx->maxSyncBytes)));
+}
+
+/*
+ * Move or link the local copy of file from the source album of item into its album, if the local copy and the
+ * remote file still match the size and dates, recorded in the manifest, otherwise back it up.
+ * Returns the file size, or negative error.
+ */
+int moveLocalFile(const int volRef, const planItem *item) {
+    const albumSnapshot *album = item->album, *source = item->source;
+    char rmPath[strlen(album->rmPath) + strlen(item->name) + 2], srcRmPath[strlen(source->rmPath) + strlen(item->name) + 2];
+    char lcPath[strlen(album->lcPath) + strlen(item->name) + 2], srcLcPath[strlen(source->lcPath) + strlen(item->name) + 2];
+    char key[sizeof(rmPath) + sizeof(srcRmPath) + 12];
+    const manifestEntry *known;
+    struct stat fileStat;
+    FileRef fileRef;
+    int size = -1;
+    time_t date = 0;
+
+    stpcpy(stpcpy(stpcpy(rmPath, album->rmPath), "/"), item->name);
+    stpcpy(stpcpy(stpcpy(srcRmPath, source->rmPath), "/"), item->name);
+    stpcpy(stpcpy(stpcpy(lcPath, album->lcPath), "/"), item->name);
+    stpcpy(stpcpy(stpcpy(srcLcPath, source->lcPath), "/"), item->name);
+    if ((known = manifestLookup(manifestKey(key, sizeof(key), volRef, srcRmPath)))
+            && !stat(srcLcPath, &fileStat) && fileStat.st_size == known->size && fileStat.st_mtime == known->lcDate
+            && access(lcPath, F_OK) && dlp_VFSFileOpen(ctx->sd, volRef, rmPath, vfsModeRead, &fileRef) >= 0) {
+        if (dlp_VFSFileSize(ctx->sd, fileRef, &size) >= 0 && size == known->size)
+            date = getRemoteDate(fileRef, volRef, rmPath, NULL);
+        dlp_VFSFileClose(ctx->sd, fileRef);
     }
-    // Copy file.
-    jp_logf(L_INFO, "%s:      Restore '%s', size %d ...", MYNAME, lcPath, filesize);
-    for (int remaining = filesize; remaining > 0; remaining -= piBuf->used) {
-        if (fileRead(0, fileP, piBuf, remaining) < 0) {
-            filesize = -1; // remember error
-            break;
-        }
-        if (fileWrite(fileRef, NULL, piBuf, remaining) < 0) {
-            filesize = -1; // remember error
-            break;
-        }
+    if (!date || date != known->rmDate || (item->op == OP_MOVE_LOCAL ? rename(srcLcPath, lcPath) : link(srcLcPath, lcPath))) {
+        logDebug("%s:      File '%s' differs from '%s', so backup it.\n", MYNAME, rmPath, srcRmPath);
+        return backupFileIfNeeded(volRef, album->rmPath, album->lcPath, item->name);
     }
-    setRemoteDate(fileRef, volRef, rmPath, fstat.st_mtime);
-    dlp_VFSFileClose(sd, fileRef);
-    if (filesize < 0) { // close and remove the partially created file
-        if (piErrLog(dlp_VFSFileDelete(sd, volRef, rmPath), L_FATAL, volRef, rmPath, "      ", ": Not deleted remote file","") >= 0)
-            jp_logf(L_WARN, "%s:       WARNING: Deleted incomplete remote file '%s' on volume %d\n", MYNAME, rmPath, volRef);
-    } else
-        jp_logf(L_INFO, " OK\n");
+    jp_logf(L_INFO, "%s:      %s '%s' from '%s', size %d ... OK\n", MYNAME,
+            item->op == OP_MOVE_LOCAL ? "Move" : "Link", rmPath, source->rmPath, size);
+    if (ctx->useManifest)
+        manifestRecord(manifestKey(key, sizeof(key), volRef, rmPath), size, date, fileStat.st_mtime);
+    return size;
+}
 
-Exit:
-    fclose(fileP);
-    jp_logf(L_DEBUG, "%s:       Restore file size / copy result: %d, statErr=%d\n", MYNAME, filesize, statErr);
-    return filesize;
+typedef struct journalTask {poolTask task; int volRef; time_t rmDate; char paths[];} journalTask; // rmPath, then lcPath
+
+static void runJournalTask(poolTask *task) {
+    journalTask *jt = (journalTask *)task;
+    journalRecord(jt->volRef, jt->paths, jt->rmDate, getLocalDate(jt->paths + strlen(jt->paths) + 1));
 }
 
 /*
- * Synchonize a remote album with the matching local album and backup or restore the containing files in them.
+ * Record the album in the journal, if all its plan items are done. This is left to the pool with a fence,
+ * so the local date is taken after the dates, which were submitted before, without waiting for them here.
  */
-PI_ERR syncAlbum(const unsigned volRef, FileRef dirRef, const char *rmRoot, DIR *dirP, const char *lcRoot, const char *album) {
-    char rmTmp[album ? strlen(rmRoot) + strlen(album) + 2 : 0], *rmAlbum = rmTmp, *dir;
-    char lcTmp[album ? strlen(lcRoot) + strlen(album) + 2 : 0], *lcAlbum = lcTmp;
-    VFSDirInfo dirInfos[MAX_DIR_ITEMS];
-    int dirItems = 0;
-    struct stat fstat;
-    int statErr;
-    PI_ERR result = 0;
+static void journalAlbum(const rootSnapshot *snap, albumSnapshot *album) {
+    if (album->pending || album->unfinished || album->failed || album->journaled || !(album->onRemote || album->onLocal))  return;
+    time_t rmDate = getRemoteDate(0, snap->volRef, album->rmPath, NULL);
+    size_t rmSize = strlen(album->rmPath) + 1;
+    journalTask *jt;
+    album->journaled = 1;
+    if (!rmDate)  return;
+    if (!(jt = malloc(sizeof(journalTask) + rmSize + strlen(album->lcPath) + 1))) { // so do it now
+        poolDrain(); // for the local date
+        journalRecord(snap->volRef, album->rmPath, rmDate, getLocalDate(album->lcPath));
+        return;
+    }
+    jt->task = (poolTask){.run = runJournalTask, .fence = 1, .detached = 1};
+    jt->volRef = snap->volRef;
+    jt->rmDate = rmDate;
+    strcpy(stpcpy(jt->paths, album->rmPath) + 1, album->lcPath);
+    poolSubmit(&jt->task);
+}
 
-    if (album) {
-        stpcpy(stpcpy(dir = stpcpy(rmAlbum ,rmRoot), "/"), album);
-        if (!cmpExcludeDirList(volRef, rmAlbum))  return result;
-        if (dirP) // indicates, that we are in restore-only mode, so
-            dirItems = -1; // prevent search on remote album
-        strcpy(lcAlbum, lcRoot);
-        if (createLocalDir(lcAlbum, dir, dirP ? -1 : volRef, rmRoot)) { // in restore-only mode don't try to recover date
-            return -2;
-        } else if (!(dirP = opendir(lcAlbum))) {
-            jp_logf(L_FATAL, "%s:    ERROR: Could not open dir '%s' on '%s'\n", MYNAME, album, lcRoot);
-            return -2;
-        }
-        if (createRemoteDir(volRef, rmAlbum, NULL, lcAlbum) < 0) {
-            result = -2;
-            goto Exit1;
-        } else if (piErrLog(dlp_VFSFileOpen(sd, volRef, rmAlbum, vfsModeRead, &dirRef),
-                L_FATAL, volRef, rmAlbum, "   ", ": Could not open dir", "") < 0) {
-            result = -2;
-            goto Exit1;
+/* Run the operations of the plan in order, where the operations of an album are skipped, if its dir can't be created. */
+PI_ERR executePlan(const rootSnapshot *snap, const syncPlan *plan) {
+    PI_ERR result = 0;
+    albumSnapshot *album = NULL;
+    int deferred = 0;
+    long long deferredBytes = 0;
+    for (int i = 0; i < plan->count; i++)
+        plan->items[i].album->pending++;
+    for (int i = 0; i < plan->count; i++) {
+        planItem *item = plan->items + i;
+        int volRef = snap->volRef, opResult = 0;
+        if (item->album != album) {
+            if (album)
+                logDebug("%s:    Album '%s' done -> result=%d\n", MYNAME, album->rmPath, result);
+            album = item->album;
+            TRACE(TRACE_ALBUM, volRef, 0, 0, album->rmPath);
+            jp_logf(ctx->scheduleOrder == SCHEDULE_LISTED ? L_INFO : L_DEBUG, // otherwise the albums alternate
+                    "%s:    Sync album '%s' in '%s' on volume %d ...\n", MYNAME, album->name ? album->name : ".", snap->rmRoot, volRef);
         }
-    } else {
-        rmAlbum = (char *)rmRoot;
-        lcAlbum = (char *)lcRoot;
-        if (!cmpExcludeDirList(volRef, rmAlbum))  return result;
-    }
-    jp_logf(L_INFO, "%s:    Sync album '%s' in '%s' on volume %d ...\n", MYNAME, album ? album : ".", rmRoot, volRef);
-    if (!dirItems) // We are in backup mode !
-        dirItems = enumerateOpenDir(volRef, dirRef, rmAlbum, dirInfos);
-    jp_logf(L_DEBUG, "%s:     Now first search of local files, which to restore ...\n", MYNAME);
-    // First iterate over all the local files in the album dir, to prevent from back-storing renamed files,
-    // so only looking for remotely unknown files ... and then restore them.
-    for (struct dirent *entry; doRestore && (entry = readdir(dirP));) {
-        jp_logf(L_DEBUG, "%s:      Found local file: '%s' type=%d\n", MYNAME, entry->d_name, entry->d_type);
-        char lcAlbumPath[NAME_MAX];
-        if ((statErr = stat(strcat(strcat(strcpy(lcAlbumPath, lcAlbum), "/"), entry->d_name), &fstat))) {
-            jp_logf(L_FATAL, "%s:      ERROR %d: Could not read status of %s; No sync possible!\n", MYNAME, statErr, lcAlbumPath);
-            result = MIN(result, -1);
+        album->pending--;
+        if (album->failed)  continue;
+        if ((item->op == OP_RESTORE || item->op == OP_BACKUP) && overBudget(item)) { // leave it for the next HotSync
+            logDebug("%s:      Budget exhausted, deferring '%s/%s'\n", MYNAME, album->rmPath, item->name);
+            TRACE(TRACE_DEFERRED, volRef, 0, item->size, item->name);
+            album->unfinished++;
+            ctx->journal.incomplete = 1;
+            deferred++;
+            if (item->size > 0)  deferredBytes += item->size;
             continue;
         }
-        if (S_ISREG(fstat.st_mode) // use fstat to follow symlinks; (entry->d_type != DT_REG) doesn't do this
-                && strlen(entry->d_name) > 2
-                && casecmpFileTypeList(entry->d_name) > 0
-                && cmpRemote(dirInfos, dirItems, entry->d_name)) {
-            //~ jp_logf(L_DEBUG, "%s:      Restore local file: '%s' to '%s'\n", MYNAME, entry->d_name, rmAlbum);
-            int restoreResult = restoreFile(lcAlbum, volRef, rmAlbum, entry->d_name);
-            result = MIN(result, restoreResult);
-        }
-    }
-    jp_logf(L_DEBUG, "%s:     Now search of %d remote files, which to backup ...\n", MYNAME, dirItems);
-    // Iterate over all the remote files in the album dir, looking for un-synced files.
-    for (int i=0; doBackup && i<dirItems; i++) {
-        char *fname = dirInfos[i].name;
-        jp_logf(L_DEBUG, "%s:      Found remote file '%s' attributes=%x\n", MYNAME, fname, dirInfos[i].attr);
-        // Grab only regular files, but ignore the 'read only' and 'archived' bits, and only with known extensions.
-        if (!(dirInfos[i].attr & (
-                vfsFileAttrHidden      |
-                vfsFileAttrSystem      |
-                vfsFileAttrVolumeLabel |
-                vfsFileAttrDirectory   |
-                vfsFileAttrLink))
-                && strlen(fname) > 1
-                && casecmpFileTypeList(fname) >= 0) {
-            //~ jp_logf(L_DEBUG, "%s:      Backup remote file: '%s' to '%s'\n", MYNAME, fname, lcAlbum);
-            int backupResult = backupFileIfNeeded(volRef, rmAlbum, lcAlbum, fname);
-            result = MIN(result, backupResult);
-        }
-    }
-    time_t date = getRemoteDate(dirRef, volRef, rmAlbum, NULL);
-    if (doBackup && date)  setLocalDate(lcAlbum, date); // always recover folder date from remote // ToDo: maybe do by BackupFileIfNeeded()
-    if (album)  dlp_VFSFileClose(sd, dirRef);
-Exit1:
-    if (album)  closedir(dirP);
-    else  rewinddir(dirP);
-    jp_logf(L_DEBUG, "%s:    Album '%s' done -> result=%d\n", MYNAME,  rmAlbum, result);
+        switch (item->op) {
+            case OP_MKDIR_LOCAL: {
+                char path[strlen(album->lcPath) + 2], dir[strlen(album->name) + 2];
+                strcpy(path, snap->lcRoot);
+                stpcpy(stpcpy(dir, "/"), album->name);
+                if (createLocalDir(path, dir, volRef, snap->rmRoot))
+                    album->failed = 1;
+                break;
+            }
+            case OP_MKDIR_REMOTE: {
+                char path[strlen(album->rmPath) + 2], dir[strlen(album->name) + 2];
+                strcpy(path, snap->rmRoot);
+                stpcpy(stpcpy(dir, "/"), album->name);
+                if (createRemoteDir(volRef, path, dir, snap->lcRoot) < 0)
+                    album->failed = 1;
+                break;
+            }
+            case OP_RESTORE:
+                if ((opResult = restoreFile(album->lcPath, volRef, album->rmPath, item->name)) >= 0) {
+                    item->size = opResult;
+                    item->done = 1;
+                    album->restored++;
+                }
+                break;
+            case OP_BACKUP:
+                loadAlbumIndex(volRef, album, plan);
+                opResult = backupFileIfNeeded(volRef, album->rmPath, album->lcPath, item->name);
+                break;
+            case OP_MOVE_LOCAL:
+            case OP_LINK_LOCAL:
+                opResult = moveLocalFile(volRef, item);
+                break;
+            case OP_DATE_LOCAL: { // always recover folder date from remote, as backups changed it
+                time_t date = getRemoteDate(0, volRef, album->rmPath, NULL);
+                if (date)  queueLocalDate(album->lcPath, date, 1); // after the dates of its files
+                break;
+            }
+        }
+        TRACE(TRACE_PLAN_OP + item->op, volRef, opResult, item->size, item->name);
+        if (album->failed)
+            result = MIN(result, -2);
+        result = MIN(result, opResult);
+        if (opResult < 0)
+            album->unfinished++;
+        else if (planPhase(item->op) == 1) {
+            char rmPath[strlen(album->rmPath) + strlen(item->name) + 2];
+            journalRecord(volRef, strcat(strcat(strcpy(rmPath, album->rmPath), "/"), item->name), 0, 0);
+        }
+        journalAlbum(snap, album);
+    }
+    for (int i = 0; i < snap->count; i++) { // also the albums without anything to do
+        albumSnapshot *a = snap->albums + i;
+        if (a->name && a->restored && strcmp(a->name, "#Thumbnail") && updateAlbumDb(snap->volRef, a, plan) < 0)
+            result = MIN(result, -1);
+        journalAlbum(snap, a);
+    }
+    if (album)
+        logDebug("%s:    Album '%s' done -> result=%d\n", MYNAME, album->rmPath, result);
+    if (deferred)
+        jp_logf(L_INFO, "%s:   Budget of the sync exhausted, so %d files (at least %lld bytes) in '%s' are left for the next HotSync.\n",
+                MYNAME, deferred, deferredBytes, snap->rmRoot);
     return result;
 }
 
-/*
- *  Backup all albums from volume volRef.
- */
 PI_ERR syncVolume(int volRef) {
     PI_ERR rootResult = -3, result = 0;
 
-    jp_logf(L_DEBUG, "%s:  Searching roots on volume %d\n", MYNAME, volRef);
-    for (fullPath *item = rootDirList; item; item = item->next) {
+    logDebug("%s:  Searching roots on volume %d\n", MYNAME, volRef);
+    for (fullPath *item = ctx->rootDirList; item; item = item->next) {
         if ((item->volRef >= 0 && volRef != item->volRef))
             continue;
         char *rootDir = item->name;
-        VFSDirInfo dirInfos[MAX_DIR_ITEMS];
+        if (!cmpExcludeDirList(volRef, rootDir))
+            continue; // pruned without asking the Palm
 
         // Open the remote root directory.
         FileRef dirRef;
-        if (piErrLog(dlp_VFSFileOpen(sd, volRef, rootDir, vfsModeRead, &dirRef), L_DEBUG, volRef, rootDir, "  ", ": Root", "; seems not to exist.") < 0)
+        if (piErrLog(dlp_VFSFileOpen(ctx->sd, volRef, rootDir, vfsModeRead, &dirRef), L_DEBUG, volRef, rootDir, "  ", ": Root", "; seems not to exist.") < 0)
             continue;
-        jp_logf(L_DEBUG, "%s:   Opened remote root '%s' on volume %d\n", MYNAME, rootDir, volRef);
+        logDebug("%s:   Opened remote root '%s' on volume %d\n", MYNAME, rootDir, volRef);
         rootResult = 0;
 
         // Open the local root directory.
         char *lcRoot = localRoot(volRef);
         if (!lcRoot)
             goto Continue;
-        DIR *dirP;
-        if (!(dirP = opendir(lcRoot))) {
-            jp_logf(L_DEBUG, "%s:   Root '%s' does not exist on '%s'\n", MYNAME, lcRoot + strlen(mediaHome), mediaHome);
+        if (access(lcRoot, F_OK) && !ctx->dryRun) { // a dry run doesn't create it
+            logDebug("%s:   Root '%s' does not exist on '%s'\n", MYNAME, lcRoot + strlen(ctx->mediaHome), ctx->mediaHome);
             goto Continue;
         }
-        jp_logf(L_DEBUG, "%s:   Opened local root '%s' on '%s'\n", MYNAME, lcRoot + strlen(mediaHome), mediaHome);
-
-        // Fetch the unfiled album, which is simply the root dir, and sync it.
-        // Apparently the Treo 650 can store media in the root dir, as well as in album dirs.
-        result = syncAlbum(volRef, dirRef, rootDir, dirP, lcRoot, NULL);
-
-        // Iterate through the remote root directory, looking for things that might be albums.
-        int dirItems = 0;
-        //~ enum dlpVFSFileIteratorConstants itr = vfsIteratorStart;
-        //~ while (itr != vfsIteratorStop) { // doesn't work because of type mismatch bug <https://github.com/juddmon/jpilot/issues/39>
-        unsigned long itr = (unsigned long)vfsIteratorStart;
-        for (int batch; (enum dlpVFSFileIteratorConstants)itr != vfsIteratorStop; dirItems += batch) {
-            batch = MIN(MAX_DIR_ITEMS / 2, MAX_DIR_ITEMS - dirItems);
-            jp_logf(L_DEBUG, "%s:   Enumerate root '%s': dirRef=%8lx, itr=%4lx, batch=%d, dirItems=%d\n", MYNAME, rootDir, dirRef, itr, batch, dirItems);
-            PI_ERR piErr;
-            if ((piErr = piErrLog(dlp_VFSDirEntryEnumerate(sd, dirRef, &itr, &batch, dirInfos + dirItems),
-                    L_FATAL, volRef, rootDir, "  ", ": Could not enumerate dir", "")) < 0) {
-                // Crashes on empty directory (see: <https://github.com/juddmon/jpilot/issues/??>):
-                // Further research is neccessary (see: <https://github.com/juddmon/jpilot/issues/41> ):
-                // - Why in case of i.e. setting batch=4, itr == vfsIteratorStop, even if there are more than 4 files?
-                // - For workaround and additional bug on SDCard volume, see at syncAlbum()
-                //~ jp_logf(L_DEBUG, "%s:   Enumerate ERROR %4d: dirRef=%8lx, itr=%4lx, batch=%d\n", MYNAME, piErr, dirRef, itr, batch);
-                rootResult = -3;
-                break;
-            //~ } else {
-                //~ jp_logf(L_DEBUG, "%s:   Enumerate OK %4d, dirRef=%8lx, itr=%4lx, batch=%d\n", MYNAME, piErr, dirRef, itr, batch);
-            }
-            jp_logf(L_DEBUG, "%s:   Now search for remote albums on Volume %d in '%s' to sync ...\n", MYNAME, volRef, rootDir);
-            for (int i = dirItems; i < (dirItems + batch); i++) {
-                jp_logf(L_DEBUG, "%s:    Found remote album candidate '%s' in '%s'; attributes=%x\n", MYNAME,  dirInfos[i].name, rootDir, dirInfos[i].attr);
-                if (dirInfos[i].attr & vfsFileAttrDirectory
-                        && (syncThumbnailDir || strcmp(dirInfos[i].name, "#Thumbnail"))) { // Treo 650 has #Thumbnail dir that is not an album
-                    jp_logf(L_DEBUG, "%s:    Found real remote album '%s' in '%s'\n", MYNAME, dirInfos[i].name, rootDir);
-                    PI_ERR albumResult = syncAlbum(volRef, 0, rootDir, NULL, lcRoot, dirInfos[i].name);
-                    result = MIN(result, albumResult);
-                }
-            }
-        }
 
-        // Now iterate over all the local files in the album dir. To prevent from back-storing renamed files,
-        // only looking for remotely unknown albums ... and then restore them.
-        jp_logf(L_DEBUG, "%s:   Now search for local albums in '%s' to restore ...\n", MYNAME, lcRoot);
-        for (struct dirent *entry; (entry = readdir(dirP));) {
-            jp_logf(L_DEBUG, "%s:    Found local album candidate '%s' in '%s'; type %d\n", MYNAME, entry->d_name, lcRoot + strlen(mediaHome) + 1, entry->d_type);
-            struct stat fstat;
-            int statErr;
-            char lcAlbum[NAME_MAX];
-            if ((statErr = stat(strcat(strcat(strcpy(lcAlbum, lcRoot), "/"), entry->d_name), &fstat))) {
-                jp_logf(L_FATAL, "%s:    ERROR %d: Could not read status of %s; No sync possible!\n", MYNAME, statErr, lcAlbum);
+        // Phase 1: Snapshot of the remote and local albums.
+        rootSnapshot snap;
+        syncPlan plan;
+        rootResult = snapshotRoot(&snap, volRef, dirRef, rootDir, lcRoot);
+        if (snap.errors)  result = MIN(result, -2);
+        // Phase 2: Plan of what to do.
+        double start = monotonicSecs();
+        if (snap.count && diffSnapshot(&snap, &plan) == EXIT_SUCCESS) {
+            logDebug("%s:   Diff of %d albums into %d operations took %.3f ms\n", MYNAME, snap.count, plan.count, (monotonicSecs() - start) * 1e3);
+            if (ctx->dryRun || ctx->scheduleOrder == SCHEDULE_SMALLEST || ctx->scheduleOrder == SCHEDULE_NEWEST)
+                resolvePlan(&snap, &plan, ctx->scheduleOrder == SCHEDULE_NEWEST);
+            if (schedulePlan(&plan) != EXIT_SUCCESS)
                 result = MIN(result, -2);
-                continue;
+            logPlan(&snap, &plan);
+            // Phase 3: Do it.
+            if (!ctx->dryRun) {
+                PI_ERR planResult = executePlan(&snap, &plan);
+                result = MIN(result, planResult);
             }
-            if (S_ISDIR(fstat.st_mode) // use fstat to follow symlinks; (entry->d_type != DT_Dir) doesn't do this
-                    && strcmp(entry->d_name, ".")
-                    && strcmp(entry->d_name, "..")
-                    && (syncThumbnailDir || strcmp(entry->d_name, "#Thumbnail")) // Treo 650 has #Thumbnail dir that is not an album
-                    && strcmp(entry->d_name, ADDITIONAL_FILES + 1)
-                    && cmpRemote(dirInfos, dirItems, entry->d_name)) {
-                jp_logf(L_DEBUG, "%s:    Found real local album '%s' in '%s'\n", MYNAME, entry->d_name, lcRoot + strlen(mediaHome) + 1);
-                PI_ERR albumResult = syncAlbum(volRef, 0, rootDir, dirP, lcRoot, entry->d_name);
-                result = MIN(result, albumResult);
-            }
-        }
-
-        closedir(dirP);
+            freePlan(&plan);
+        } else
+            result = MIN(result, -2);
+        freeSnapshot(&snap);
         // Reset date of lcRoot
         time_t date = getRemoteDate(dirRef, volRef, rootDir, NULL);
-        if (date)  setLocalDate(lcRoot, date);
+        poolDrain(); // the dates in the root
+        if (date && !ctx->dryRun)  setLocalDate(lcRoot, date);
 Continue:
-        dlp_VFSFileClose(sd, dirRef);
+        dlp_VFSFileClose(ctx->sd, dirRef);
     }
-    jp_logf(L_DEBUG, "%s:  Volume %d done -> rootResult=%d, result=%d\n", MYNAME,  volRef, rootResult, result);
+    logDebug("%s:  Volume %d done -> rootResult=%d, result=%d\n", MYNAME,  volRef, rootResult, result);
     return rootResult + result;
 }
 
@@ -876,23 +3326,23 @@ int volumeEnumerateIncludeHidden(const int sd, int *numVols, int *volRefs) {
     // -301 : PalmOS Error. Probably no volume (SDCard) found, but maybe hidden volume 1 exists
     //    4 : At least one volume found, but maybe additional hidden volume 1 exists
     piErr = dlp_VFSVolumeEnumerate(sd, numVols, volRefs);
-    jp_logf(L_DEBUG, "%s: dlp_VFSVolumeEnumerate(): %s; found %d volumes\n", MYNAME, errString(1, piErr, L_DEBUG, ""), *numVols);
+    logDebug("%s: dlp_VFSVolumeEnumerate(): %s; found %d volumes\n", MYNAME, errString(1, piErr, L_DEBUG, ""), *numVols);
     // On the Centro, Treo 650 and maybe more, it appears that the first non-hidden volRef is 2, and the hidden volRef is 1.
     // Let's poke around to see, if there is really a volRef 1 that's hidden from the dlp_VFSVolumeEnumerate().
     if (piErr < 0)  *numVols = 0; // On Error reset numVols
     for (int i=0; i<*numVols; i++) { // Search for volume 1
-        jp_logf(L_DEBUG, "%s: *numVols=%d, volRefs[%d]=%d\n", MYNAME, *numVols, i, volRefs[i]);
+        logDebug("%s: *numVols=%d, volRefs[%d]=%d\n", MYNAME, *numVols, i, volRefs[i]);
         if (volRefs[i]==1)
             goto Exit; // No need to search for hidden volume
     }
-    if (piErrLog(dlp_VFSVolumeInfo(sd, 1, &volInfo), L_FATAL, 1, "", "", ": Could not find info","") >= 0 && volInfo.attributes & vfsVolAttrHidden) {
-        jp_logf(L_DEBUG, "%s: Found hidden volume 1\n", MYNAME);
+    if (piErrLog(getVolumeInfo(1, &volInfo), L_FATAL, 1, "", "", ": Could not find info","") >= 0 && volInfo.attributes & vfsVolAttrHidden) {
+        logDebug("%s: Found hidden volume 1\n", MYNAME);
         if (*numVols < MAX_VOLUMES)  (*numVols)++;
         else {
             jp_logf(L_FATAL, "%s: ERROR: Volumes > %d were discarded\n", MYNAME, MAX_VOLUMES);
         }
         for (int i = (*numVols)-1; i > 0; i--) { // Move existing volRefs
-            jp_logf(L_DEBUG, "%s: *numVols=%d, volRefs[%d]=%d, volRefs[%d]=%d\n", MYNAME, *numVols, i-1, volRefs[i-1], i, volRefs[i]);
+            logDebug("%s: *numVols=%d, volRefs[%d]=%d, volRefs[%d]=%d\n", MYNAME, *numVols, i-1, volRefs[i-1], i, volRefs[i]);
             volRefs[i] = volRefs[i-1];
         }
         volRefs[0] = 1;
@@ -900,7 +3350,7 @@ int volumeEnumerateIncludeHidden(const int sd, int *numVols, int *volRefs) {
             piErr = 4; // fake dlp_VFSVolumeEnumerate() with 1 volume return value
     }
 Exit:
-    jp_logf(L_DEBUG, "%s: volumeEnumerateIncludeHidden(): Found %d volumes -> piErr=%d\n", MYNAME, *numVols, piErr);
+    logDebug("%s: volumeEnumerateIncludeHidden(): Found %d volumes -> piErr=%d\n", MYNAME, *numVols, piErr);
     return piErr;
 }
 
@@ -958,62 +3408,133 @@ int plugin_startup(jp_startup_info *info) {
     return EXIT_SUCCESS;
 }
 
-int plugin_sync(int socket) {
-    sd = socket;
+/* Free and reset, what a sync or diff has set up in the context, so it can serve the next one. */
+static void resetSync(void) {
+    pi_buffer_free(ctx->piBuf);
+    pi_buffer_free(ctx->piBuf2);
+    ctx->piBuf = ctx->piBuf2 = NULL;
+    for (int i = 0; i < RING_BUFFERS; i++) {
+        pi_buffer_free(ctx->ringBufs[i]);
+        ctx->ringBufs[i] = NULL;
+    }
+    freePathList(ctx->rootDirList);
+    freePathList(ctx->fileTypeList);
+    freePathList(ctx->excludeDirList);
+    freePathList(ctx->deleteFileList);
+    freePathList(ctx->additionalFileList);
+    ctx->rootDirList = ctx->fileTypeList = ctx->excludeDirList = ctx->deleteFileList = ctx->additionalFileList = NULL;
+    free(ctx->fileTypeMatcher.slots);
+    memset(&ctx->fileTypeMatcher, 0, sizeof(ctx->fileTypeMatcher));
+    pathTrieFree(&ctx->excludeTrie);
+    freeIteratorStrategies();
+    freeChunkTuners();
+    freePartials();
+    metaCacheFree(); // the device may have changed since
+    jp_free_prefs(ctx->prefs, NUM_PREFS);
+    memcpy(ctx->prefs, PREFS, sizeof(PREFS));
+    jp_pref_init(ctx->prefs, NUM_PREFS);
+    ctx->importantWarning = 0;
+}
+
+/* Merge the updates recorded so far into the manifest file and map it afresh. */
+static void manifestReload(void) {
+    manifestSave();
+    manifestFree();
+    manifestLoad();
+}
 
-    // Read and process preferences.
-    jp_pref_init(prefs, NUM_PREFS);
-    if (jp_pref_read_rc_file(PREFS_FILE, prefs, NUM_PREFS) < 0)
+/* Read and process the preferences; returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int readPrefs(void) {
+    resetSync();
+    if (jp_pref_read_rc_file(PREFS_FILE, ctx->prefs, NUM_PREFS) < 0)
         jp_logf(L_WARN, "%s: WARNING: Could not read prefs[] from '%s'\n", MYNAME, PREFS_FILE);
-    if (jp_pref_write_rc_file(PREFS_FILE, prefs, NUM_PREFS) < 0) // If pref file wasn't existent ...
+    if (jp_pref_write_rc_file(PREFS_FILE, ctx->prefs, NUM_PREFS) < 0) // If pref file wasn't existent ...
         jp_logf(L_WARN, "%s: WARNING: Could not write prefs[] to '%s'\n", MYNAME, PREFS_FILE); // initialize with defaults.
-    jp_get_pref(prefs, 0, &prefsVersion, NULL);
-    if (prefsVersion != PREFS_VERSION) {
+    jp_get_pref(ctx->prefs, 0, &ctx->prefsVersion, NULL);
+    if (ctx->prefsVersion != PREFS_VERSION) {
         jp_logf(L_FATAL, "%s: ERROR: Version of preferences file '%s' must be %d, please update it!\n", MYNAME, PREFS_FILE, PREFS_VERSION);
         return EXIT_FAILURE;
     }
-    jp_get_pref(prefs, 1, NULL, (const char **)&rootDirs);
-    jp_get_pref(prefs, 2, &syncThumbnailDir, NULL);
-    jp_get_pref(prefs, 3, NULL, (const char **)&fileTypes);
-    jp_get_pref(prefs, 4, &useDateModified, NULL);
-    jp_get_pref(prefs, 5, &compareContent, NULL);
-    jp_get_pref(prefs, 6, &doBackup, NULL);
-    jp_get_pref(prefs, 7, &doRestore, NULL);
-    jp_get_pref(prefs, 8, &listFiles, NULL);
-    jp_get_pref(prefs, 9, NULL, (const char **)&excludeDirs);
-    jp_get_pref(prefs, 10, NULL, (const char **)&deleteFiles);
-    jp_get_pref(prefs, 11, NULL, (const char **)&additionalFiles);
-    if (    parsePaths(rootDirs, &rootDirList, prefs[1].name) != EXIT_SUCCESS ||
-            parsePaths(fileTypes, &fileTypeList, prefs[3].name) != EXIT_SUCCESS ||
-            parsePaths(excludeDirs, &excludeDirList, prefs[9].name) != EXIT_SUCCESS ||
-            parsePaths(deleteFiles, &deleteFileList, prefs[10].name) != EXIT_SUCCESS ||
-            parsePaths(additionalFiles, &additionalFileList, prefs[11].name) != EXIT_SUCCESS ||
-            !(piBuf = pi_buffer_new(32768)) || !(piBuf2 = pi_buffer_new(32768))) {
+    jp_get_pref(ctx->prefs, 1, NULL, (const char **)&ctx->rootDirs);
+    jp_get_pref(ctx->prefs, 2, &ctx->syncThumbnailDir, NULL);
+    jp_get_pref(ctx->prefs, 3, NULL, (const char **)&ctx->fileTypes);
+    jp_get_pref(ctx->prefs, 4, &ctx->useDateModified, NULL);
+    jp_get_pref(ctx->prefs, 5, &ctx->compareContent, NULL);
+    jp_get_pref(ctx->prefs, 6, &ctx->doBackup, NULL);
+    jp_get_pref(ctx->prefs, 7, &ctx->doRestore, NULL);
+    jp_get_pref(ctx->prefs, 8, &ctx->listFiles, NULL);
+    jp_get_pref(ctx->prefs, 9, NULL, (const char **)&ctx->excludeDirs);
+    jp_get_pref(ctx->prefs, 10, NULL, (const char **)&ctx->deleteFiles);
+    jp_get_pref(ctx->prefs, 11, NULL, (const char **)&ctx->additionalFiles);
+    jp_get_pref(ctx->prefs, 12, &ctx->useManifest, NULL);
+    jp_get_pref(ctx->prefs, 13, &ctx->chunkSize, NULL);
+    jp_get_pref(ctx->prefs, 14, &ctx->dryRun, NULL);
+    jp_get_pref(ctx->prefs, 15, &ctx->scheduleOrder, NULL);
+    jp_get_pref(ctx->prefs, 16, &ctx->maxSyncSecs, NULL);
+    jp_get_pref(ctx->prefs, 17, &ctx->maxSyncBytes, NULL);
+    jp_get_pref(ctx->prefs, 18, &ctx->traceSync, NULL);
+    jp_get_pref(ctx->prefs, 19, &ctx->listDetails, NULL);
+    jp_get_pref(ctx->prefs, 20, &ctx->albumDepth, NULL);
+    if (    parsePaths(ctx->rootDirs, &ctx->rootDirList, ctx->prefs[1].name) != EXIT_SUCCESS ||
+            parsePaths(ctx->fileTypes, &ctx->fileTypeList, ctx->prefs[3].name) != EXIT_SUCCESS ||
+            parsePaths(ctx->excludeDirs, &ctx->excludeDirList, ctx->prefs[9].name) != EXIT_SUCCESS ||
+            parsePaths(ctx->deleteFiles, &ctx->deleteFileList, ctx->prefs[10].name) != EXIT_SUCCESS ||
+            parsePaths(ctx->additionalFiles, &ctx->additionalFileList, ctx->prefs[11].name) != EXIT_SUCCESS ||
+            typeMatcherBuild(&ctx->fileTypeMatcher, ctx->fileTypeList) != EXIT_SUCCESS ||
+            pathTrieBuild(&ctx->excludeTrie, ctx->excludeDirList) != EXIT_SUCCESS) {
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* The sync with the device at socket in the context of the calling thread. */
+static int runSync(const int socket) {
+    ctx->syncStart = monotonicSecs();
+    ctx->sd = socket;
+    memset(ctx->callStatsTable, 0, sizeof(ctx->callStatsTable));
+
+    if (readPrefs() != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    ctx->trace.next = 0;
+    if ((TRACE_ON && ctx->traceSync && !ctx->trace.events && !(ctx->trace.events = calloc(TRACE_EVENTS, sizeof(traceEvent)))) ||
+            !(ctx->piBuf = pi_buffer_new(CHUNK_MAX)) || !(ctx->piBuf2 = pi_buffer_new(CHUNK_MAX)) || newRingBuffers()) {
         jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
         return EXIT_FAILURE;
     }
 
-    // Use $JPILOT_HOME/.jpilot/ or current directory for PCDIR.
-    if (jp_get_home_file_name(PCDIR, mediaHome, NAME_MAX) < 0) {
+    // Use $JPILOT_HOME/.jpilot/ or current directory for PCDIR, if not given by the context.
+    if (!*ctx->mediaHome && jp_get_home_file_name(PCDIR, ctx->mediaHome, NAME_MAX) < 0) {
         jp_logf(L_WARN, "%s: WARNING: Could not get $JPILOT_HOME path, so using current directory.\n", MYNAME);
-        strcpy(mediaHome, "./"PCDIR);
+        strcpy(ctx->mediaHome, "./"PCDIR);
     }
-    if (listFiles)
-        jp_logf(L_INFO, "%s: List all files from the Palm device to the terminal, needs: 'jpilot -d'\n", MYNAME);
+    struct PilotUser user;
+    if (dlp_ReadUserInfo(ctx->sd, &user) >= 0)
+        ctx->userID = user.userID;
+    loadIteratorStrategies();
+    loadChunkTuners();
+    loadPartials();
+    if (ctx->useManifest)
+        manifestReload();
+    FILE *catalog = NULL;
+    if (ctx->listFiles)
+        catalog = catalogOpen();
     else {
-        jp_logf(L_INFO, "%s: Start syncing with '%s ...'\n", MYNAME, mediaHome);
+        jp_logf(L_INFO, "%s: Start syncing with '%s ...'\n", MYNAME, ctx->mediaHome);
         // Check if there are any file types loaded.
-        if (!fileTypeList) {
+        if (!ctx->fileTypeList) {
             jp_logf(L_FATAL, "%s: ERROR: Could not find any file types from '%s'; No media synced.\n", MYNAME, PREFS_FILE);
             return EXIT_FAILURE;
         }
+        journalLoad();
     }
 
     // Get list of the volumes on the pilot.
     int volRefs[MAX_VOLUMES];
     int volumes = MAX_VOLUMES;
-    if (volumeEnumerateIncludeHidden(sd, &volumes, volRefs) < 0) {
+    if (volumeEnumerateIncludeHidden(ctx->sd, &volumes, volRefs) < 0) {
         jp_logf(L_FATAL, "%s: ERROR: Could not find any VFS volumes; No files to sync or list.\n", MYNAME);
+        if (catalog)  fclose(catalog);
         return EXIT_FAILURE;
     }
 
@@ -1021,72 +3542,80 @@ int plugin_sync(int socket) {
     int result = EXIT_FAILURE;
     PI_ERR piErr;
     for (int i=0; i<volumes; i++) {
-        if (listFiles) { // List all files from the Palm device, but don't sync.
-            if (listRemoteFiles(volRefs[i], "/", 1) < 0)  goto Continue;
+        if (ctx->listFiles) { // List all files from the Palm device, but don't sync.
+            if (listRemoteFiles(volRefs[i], "/", catalog) < 0)  goto Continue;
         } else if ((piErr = syncVolume(volRefs[i])) < -2) {
-            snprintf(syncLogEntry, sizeof(syncLogEntry),
+            snprintf(ctx->syncLogEntry, sizeof(ctx->syncLogEntry),
                     "%s:  WARNING: Could not find any media on volume %d; No media synced.\n", MYNAME, volRefs[i]);
-            jp_logf(L_WARN, syncLogEntry);
-            dlp_AddSyncLogEntry (sd, syncLogEntry);
+            jp_logf(L_WARN, ctx->syncLogEntry);
+            dlp_AddSyncLogEntry (ctx->sd, ctx->syncLogEntry);
             goto Continue;
         } else if (piErr < 0) {
-            snprintf(syncLogEntry, sizeof(syncLogEntry),
+            snprintf(ctx->syncLogEntry, sizeof(ctx->syncLogEntry),
                     "%s:  WARNING: Errors occured on volume %d; Some media may not be synced.\n", MYNAME, volRefs[i]);
-            jp_logf(L_WARN, syncLogEntry);
-            dlp_AddSyncLogEntry (sd, syncLogEntry);
+            jp_logf(L_WARN, ctx->syncLogEntry);
+            dlp_AddSyncLogEntry (ctx->sd, ctx->syncLogEntry);
+            ctx->journal.incomplete = 1;
         }
         result = EXIT_SUCCESS;
 Continue:
     }
+    if (catalog && fclose(catalog))
+        jp_logf(L_WARN, "%s: WARNING: Could not write the list of files to '%s"CATALOG_FILE"'\n", MYNAME, ctx->mediaHome);
+
+    if (ctx->dryRun && (ctx->deleteFileList || ctx->additionalFileList)) {
+        jp_logf(L_INFO, "%s: Dry run, so not processing prefs 'deleteFiles' and 'additionalFiles'.\n", MYNAME);
+        freePathList(ctx->deleteFileList);
+        freePathList(ctx->additionalFileList);
+        ctx->deleteFileList = ctx->additionalFileList = NULL;
+    }
 
     // Process deleteFileList ...
-    if (deleteFileList)
+    if (ctx->deleteFileList)
         jp_logf(L_INFO, "%s: Delete files from pref 'deleteFiles' ...\n", MYNAME);
-    for (fullPath *item = deleteFileList; item; item = item->next) {
+    for (fullPath *item = ctx->deleteFileList; item; item = item->next) {
         if (item->name[0] != '/')
             jp_logf(L_WARN, "%s:     WARNING: Missing '/' at start of file '%s' on volume %d, not deleting it.\n", MYNAME, item->name, item->volRef);
-        else if ((piErrLog(dlp_VFSFileDelete(sd, item->volRef, item->name),
-                L_FATAL, item->volRef, item->name, "    ", ": Not deleted remote file","")) >= 0)
+        else if ((piErrLog(dlp_VFSFileDelete(ctx->sd, item->volRef, item->name),
+                L_FATAL, item->volRef, item->name, "    ", ": Not deleted remote file","")) >= 0) {
             jp_logf(L_INFO, "%s:     Deleted remote file '%s' on volume %d\n", MYNAME, item->name, item->volRef);
+            metaInvalidate(item->volRef, item->name, META_EXISTS | META_DATE | META_ATTR | META_SIZE);
+        }
     }
 
     // Process additionalFileList ...
-    if (additionalFileList)
-        jp_logf(L_INFO, "%s: Sync files from pref 'additionalFiles' with '%s/VOLUME%s ...'\n", MYNAME, mediaHome, ADDITIONAL_FILES);
-    for (fullPath *item = additionalFileList; item; item = item->next) {
-        jp_logf(L_DEBUG, "%s:  Sync additional file: item->volRef=%d, item->name='%s'\n", MYNAME, item->volRef, item->name);
+    if (ctx->additionalFileList)
+        jp_logf(L_INFO, "%s: Sync files from pref 'additionalFiles' with '%s/VOLUME%s ...'\n", MYNAME, ctx->mediaHome, ADDITIONAL_FILES);
+    for (fullPath *item = ctx->additionalFileList; item; item = item->next) {
+        logDebug("%s:  Sync additional file: item->volRef=%d, item->name='%s'\n", MYNAME, item->volRef, item->name);
         if (item->name[0] != '/') {
             jp_logf(L_WARN, "%s:     WARNING: Missing '/' at start of additional file '%s' on volume %d, not syncing it.\n", MYNAME, item->name, item->volRef);
             continue;
         }
         char *lcDir = localRoot(item->volRef);
         if (!lcDir || createLocalDir(lcDir, ADDITIONAL_FILES, -1, ""))  continue;
-        //~ jp_logf(L_DEBUG, "%s:     lcDir='%s', getLocalDate(lcDir)='%s'\n", MYNAME, lcDir, isoTime(getLocalDate(lcDir)));
+        //~ logDebug("%s:     lcDir='%s', getLocalDate(lcDir)='%s'\n", MYNAME, lcDir, isoTime(getLocalDate(lcDir)));
         char *fname = strrchr(item->name, '/');
-        FileRef fileRef = 0;
-        if ((piErr = dlp_VFSFileOpen(sd, item->volRef, item->name, vfsModeRead, &fileRef)) >= 0) { // Backup file ...
+        unsigned long attr = 0;
+        if ((piErr = getRemoteAttributes(item->volRef, item->name, &attr)) >= 0) { // Backup file ...
             time_t parentDate = 0;
-            unsigned long attr = 0;
-            piErr = piErrLog(dlp_VFSFileGetAttributes(sd, fileRef, &attr),
-                    L_FATAL, item->volRef, item->name, "    ", ": Could not get attributes from remote file","");
-            dlp_VFSFileClose(sd, fileRef);
-            if (doBackup) {
-                if (piErr >= 0 && attr & vfsFileAttrDirectory)
+            if (ctx->doBackup) {
+                if (attr & vfsFileAttrDirectory)
                     createLocalDir(lcDir, item->name, item->volRef, "");
                 else {
                     *fname++ = '\0'; // truncate dir part from item->name
-                    //~ jp_logf(L_DEBUG, "%s:     new item->name='%s', fname='%s'\n", MYNAME, item->name, fname);
+                    //~ logDebug("%s:     new item->name='%s', fname='%s'\n", MYNAME, item->name, fname);
                     if (!*(item->name) || !createLocalDir(lcDir, item->name, item->volRef, "")) {
                         parentDate = getLocalDate(lcDir);
                         backupFileIfNeeded(item->volRef, item->name, lcDir, fname);
-                        //~ jp_logf(L_DEBUG, "%s:     lcDir='%s', parentDate='%s'\n", MYNAME, lcDir, isoTime(parentDate));
+                        //~ logDebug("%s:     lcDir='%s', parentDate='%s'\n", MYNAME, lcDir, isoTime(parentDate));
                         if (parentDate)  setLocalDate(lcDir, parentDate); // recover parent dir date. // ToDo: maybe do by BackupFileIfNeeded()
                     }
                 }
-            } else if (doRestore) {
+            } else if (ctx->doRestore) {
                 jp_logf(L_WARN, "%s:     WARNING: Remote file '%s' on volume %d already exists. To replace, first delete it.\n", MYNAME, item->name, item->volRef);
             }
-        } else if (doRestore) { // Restore file ...
+        } else if (ctx->doRestore) { // Restore file ...
             char rmDir[NAME_MAX] = "", lcRoot[NAME_MAX];
             strcpy(lcRoot, lcDir);
             struct stat fstat;
@@ -1105,27 +3634,138 @@ Continue:
         }
     }
 
-    if (!listFiles || additionalFileList)
-        jp_logf(L_DEBUG, "%s: Sync done -> result=%d\n", MYNAME, result);
+    poolStop();
+    if (ctx->useManifest)
+        manifestSave();
+    if (!ctx->dryRun) {
+        saveIteratorStrategies();
+        saveChunkTuners();
+    }
+    journalClose(result == EXIT_SUCCESS);
+    if (!ctx->listFiles || ctx->additionalFileList)
+        logDebug("%s: Sync done -> result=%d\n", MYNAME, result);
     if (result != EXIT_SUCCESS)
-        dlp_AddSyncLogEntry (sd, "Synchronization of Media was incomplete.\n");
-    if (importantWarning) {
+        dlp_AddSyncLogEntry (ctx->sd, "Synchronization of Media was incomplete.\n");
+    if (ctx->importantWarning > 0) {
         // Avoids bug <https://github.com/desrod/pilot-link/issues/11>, as then the file "Album.db" is created, so the dir is not empty anymore.
         jp_logf(L_WARN, "\n%s: IMPORTANT WARNING: Now open once the Media app on your Palm device to avoid crash (signal SIGCHLD) on next HotSync !!!\n\n", MYNAME);
-        dlp_AddSyncLogEntry (sd, MYNAME": IMPORTANT WARNING: Now open once the Media app to avoid crash with JPilot on next HotSync !!!\n");
+        dlp_AddSyncLogEntry (ctx->sd, MYNAME": IMPORTANT WARNING: Now open once the Media app to avoid crash with JPilot on next HotSync !!!\n");
+    }
+    reportCallStats(monotonicSecs() - ctx->syncStart);
+    return result;
+}
+
+/*
+ * Create the context for the sync with one device, which keeps its media in dir home, or if NULL, in PCDIR of the
+ * JPilot home. Returns NULL, if out of memory.
+ */
+syncContext *syncContextNew(const char *home) {
+    syncContext *context = calloc(1, sizeof(syncContext));
+    if (!context)  return NULL;
+    if (home && strlen(home) >= sizeof(context->mediaHome)) {
+        free(context);
+        return NULL;
+    }
+    if (home)  strcpy(context->mediaHome, home);
+    memcpy(context->prefs, PREFS, sizeof(PREFS));
+    jp_pref_init(context->prefs, NUM_PREFS); // so resetSync() can free them
+    pthread_mutex_init(&context->callStatsLock, NULL);
+    pthread_mutex_init(&context->journalLock, NULL);
+    pthread_mutex_init(&context->pool.lock, NULL);
+    pthread_cond_init(&context->pool.changed, NULL);
+    return context;
+}
+
+/* Free the context and all, which a sync with it has allocated. */
+void syncContextFree(syncContext *context) {
+    syncContext *caller = ctx;
+    if (!context)  return;
+    ctx = context;
+    poolStop();
+    resetSync();
+    jp_free_prefs(ctx->prefs, NUM_PREFS); // Calling this in plugin_exit_cleanup() causes crash from free().
+    free(ctx->trace.events);
+    manifestFree();
+    journalClose(0);
+    pthread_mutex_destroy(&ctx->callStatsLock);
+    pthread_mutex_destroy(&ctx->journalLock);
+    pthread_mutex_destroy(&ctx->pool.lock);
+    pthread_cond_destroy(&ctx->pool.changed);
+    free(context);
+    ctx = caller;
+}
+
+/* Write the trace as tab separated lines to mediaHome/TRACE_FILE, oldest event first. */
+static void traceWrite(void) {
+    char path[NAME_MAX + sizeof(TRACE_FILE)];
+    FILE *fileP;
+
+    if (!(fileP = fopen(strcat(strcpy(path, ctx->mediaHome), TRACE_FILE), "w"))) {
+        jp_logf(L_WARN, "%s: WARNING: Cannot open '%s' for writing the trace of the sync\n", MYNAME, path);
+        return;
+    }
+    pthread_mutex_lock(&ctx->callStatsLock);
+    fprintf(fileP, "at_secs\tsecs\tevent\tvolume\tresult\tbytes\tname\n");
+    for (unsigned long i = ctx->trace.next > TRACE_EVENTS ? ctx->trace.next - TRACE_EVENTS : 0; i < ctx->trace.next; i++) {
+        const traceEvent *event = ctx->trace.events + i % TRACE_EVENTS;
+        fprintf(fileP, "%.6f\t%.6f\t%s\t%d\t%d\t%lld\t%s\n", event->at, event->secs,
+                event->kind < CALL_TYPES ? CALL_NAMES[event->kind] : event->kind < TRACE_PLAN_OP ?
+                        TRACE_NAMES[event->kind - CALL_TYPES] : PLAN_OP_NAMES[event->kind - TRACE_PLAN_OP],
+                event->volRef, event->result, (long long)event->bytes, event->name);
     }
+    pthread_mutex_unlock(&ctx->callStatsLock);
+    if (fclose(fileP))
+        jp_logf(L_WARN, "%s: WARNING: Could not write the trace of the sync to '%s'\n", MYNAME, path);
+    else
+        jp_logf(L_INFO, "%s: Trace of the last %lu events of the sync written to '%s'\n", MYNAME, MIN(ctx->trace.next, TRACE_EVENTS), path);
+}
+
+/* Sync the device at socket with the given context, which may be used by one thread at a time. */
+int syncDevice(syncContext *context, const int socket) {
+    syncContext *caller = ctx;
+    ctx = context;
+    int result = runSync(socket);
+    if (TRACE_ON && ctx->trace.events && (result != EXIT_SUCCESS || ctx->traceSync > 1))
+        traceWrite();
+    ctx = caller;
+    return result;
+}
+
+/* Record rmPath on volume volRef as synced in the manifest of the context, which is merged by the next diff or sync. */
+void syncRecord(syncContext *context, const int volRef, const char *rmPath, const int size, const time_t rmDate, const time_t lcDate) {
+    syncContext *caller = ctx;
+    char key[strlen(rmPath) + 12];
+    ctx = context;
+    manifestRecord(manifestKey(key, sizeof(key), volRef, rmPath), size, rmDate, lcDate);
+    ctx = caller;
+}
+
+/* Derive the plan from the snapshot with the prefs and the manifest of the context, like runSync(), but without a device. */
+int syncDiff(syncContext *context, rootSnapshot *snap, syncPlan *plan) {
+    syncContext *caller = ctx;
+    ctx = context;
+    int result = readPrefs();
+    if (result == EXIT_SUCCESS && ctx->useManifest)
+        manifestReload();
+    if (result == EXIT_SUCCESS)
+        result = diffSnapshot(snap, plan);
+    ctx = caller;
     return result;
 }
 
+static syncContext *pluginContext; // of the HotSync by JPilot
+
+int plugin_sync(int socket) {
+    if (!pluginContext && !(pluginContext = syncContextNew(NULL))) {
+        jp_logf(L_FATAL, "%s: ERROR: Out of memory\n", MYNAME);
+        return EXIT_FAILURE;
+    }
+    return syncDevice(pluginContext, socket);
+}
+
 int plugin_post_sync(void) {
-    pi_buffer_free(piBuf);
-    pi_buffer_free(piBuf2);
-    freePathList(rootDirList);
-    freePathList(fileTypeList);
-    freePathList(excludeDirList);
-    freePathList(deleteFileList);
-    freePathList(additionalFileList);
-    jp_free_prefs(prefs, NUM_PREFS); // Calling this in plugin_exit_cleanup() causes crash from free().
-    jp_logf(L_DEBUG, "%s: plugin_post_sync -> done.\n", MYNAME);
+    syncContextFree(pluginContext);
+    pluginContext = NULL; // so nothing is freed twice
+    logDebug("%s: plugin_post_sync -> done.\n", MYNAME);
     return EXIT_SUCCESS;
 }
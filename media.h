@@ -0,0 +1,114 @@
+/*******************************************************************************
+ * media.h
+ *
+ * Entry points of the Media sync engine beside the JPilot plugin interface,
+ * to sync devices from other programs, i.e. media-sync.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#ifndef __MEDIA_H__
+#define __MEDIA_H__
+
+#include <time.h>
+
+/* The state of the sync with one device. */
+typedef struct syncContext syncContext;
+
+/* Create the context for a device, which keeps its media in dir home, or if NULL, in the JPilot home. */
+syncContext *syncContextNew(const char *home);
+
+/* Free the context and all, which a sync with it has allocated. */
+void syncContextFree(syncContext *context);
+
+/*
+ * Sync the device at the connected pilot-link socket; returns EXIT_SUCCESS or EXIT_FAILURE.
+ * The context may serve several syncs and diffs in turn, as each starts afresh from the prefs.
+ */
+int syncDevice(syncContext *context, const int socket);
+
+/* Listing of a dir, of which the names are stored in chunks; size is -1 and date 0, if unknown. */
+typedef struct dirItem {unsigned long attr; char *name; long size; time_t date;} dirItem;
+typedef struct nameChunk nameChunk;
+typedef struct dirListing {int count, allocated; dirItem *items; nameChunk *names;} dirListing;
+
+/* Append an item to the listing, which must be zeroed before first use; returns EXIT_SUCCESS or EXIT_FAILURE. */
+int dirListingAdd(dirListing *list, const unsigned long attr, const char *name, const size_t nameLen);
+
+void dirListingFree(dirListing *list);
+
+/* Hash index over the names of a listing; without slots, i.e. if out of memory, it is searched linearly. */
+typedef struct nameIndex {const dirListing *list; unsigned mask; int *slots;} nameIndex;
+
+void nameIndexBuild(nameIndex *index, const dirListing *list);
+
+void nameIndexFree(nameIndex *index);
+
+/* Returns the item of fname in the indexed listing, or NULL, if not found. */
+const dirItem *nameIndexFind(const nameIndex *index, const char *fname);
+
+/* Snapshot of the remote and local listings of the albums of a root dir, i.e. '/DCIM' on a volume. */
+typedef struct albumSnapshot {
+    char *name; // NULL for the unfiled album, which is the root dir itself
+    char *rmPath, *lcPath;
+    int onRemote, onLocal, failed, restored, indexed;
+    int listed; // the remote listing is complete, so the manifest entries of missing files are dropped
+    int pending, unfinished, journaled; // plan items to execute, deferred or failed ones
+    dirListing rmList, lcList;
+} albumSnapshot;
+typedef struct rootSnapshot {
+    int volRef;
+    char *rmRoot, *lcRoot;
+    albumSnapshot *albums;
+    int count, errors;
+} rootSnapshot;
+
+/* Add an album of name, or if NULL, the unfiled one, to the snapshot, of which rmRoot and lcRoot must be set. */
+albumSnapshot *addAlbumSnapshot(rootSnapshot *snap, const char *name, const int onRemote, const int onLocal);
+
+/* Free the snapshot, also its rmRoot and lcRoot. */
+void freeSnapshot(rootSnapshot *snap);
+
+/* Ordered plan of operations, which syncs the albums of a snapshot. */
+enum planOp {OP_MKDIR_LOCAL, OP_MKDIR_REMOTE, OP_RESTORE, OP_BACKUP, OP_MOVE_LOCAL, OP_LINK_LOCAL, OP_DATE_LOCAL, PLAN_OPS};
+typedef struct planItem {
+    int op;
+    albumSnapshot *album, *source; // source: the album to move or link the local file from
+    const char *name;
+    long size;
+    time_t date;
+    int seq, done;
+} planItem;
+typedef struct syncPlan {
+    planItem *items;
+    int count, allocated;
+    int counts[PLAN_OPS];
+    long long bytes[PLAN_OPS];
+    int unknownSizes;
+} syncPlan;
+
+void freePlan(syncPlan *plan);
+
+/* Record rmPath on volume volRef as synced in the manifest of the context, i.e. to check syncDiff(). */
+void syncRecord(syncContext *context, const int volRef, const char *rmPath, const int size, const time_t rmDate, const time_t lcDate);
+
+/*
+ * Derive the plan from the snapshot, as a sync with the context would, but without a device. The prefs are read,
+ * and the recorded files are merged into the manifest in the home of the context, which must be given.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int syncDiff(syncContext *context, rootSnapshot *snap, syncPlan *plan);
+
+#endif
@@ -0,0 +1,113 @@
+/*******************************************************************************
+ * mediasync.c
+ *
+ * Headless sync of the media of a Palm device, as the Media plugin does on a
+ * HotSync with JPilot, i.e. for scripts and cron jobs.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pi-dlp.h>
+#include <pi-socket.h>
+
+#include "libplugin.h"
+#include "jpstub.h"
+#include "media.h"
+
+static const char USAGE[] =
+"Usage: media-sync [options]\n\
+Syncs the media of a Palm device like the Media plugin on a HotSync with JPilot,\n\
+with the prefs from '$JPILOT_HOME/.jpilot/"PACKAGE".rc'.\n\
+  -p port  pilot-link port of the device (default: $PILOTPORT, or usb:)\n\
+  -m dir   dir to sync the media with (default: $JPILOT_HOME/.jpilot/"PACKAGE_NAME")\n\
+  -o n=v   set pref n to value v for this sync only, i.e. -o dryRun=1\n\
+  -d       print also the debug log\n\
+  -q       print only errors\n";
+
+/* Wait for the device on port and open the conduit, like the pilot-link tools do. Returns the socket, or -1. */
+static int connectDevice(const char *port, int *listenSd) {
+    int sd;
+
+    if ((*listenSd = pi_socket(PI_AF_PILOT, PI_SOCK_STREAM, PI_PF_DLP)) < 0) {
+        fprintf(stderr, "Could not create pilot-link socket\n");
+        return -1;
+    }
+    if (pi_bind(*listenSd, port) < 0) {
+        fprintf(stderr, "Could not bind to port '%s'\n", port);
+        return -1;
+    }
+    fprintf(stderr, "Listening on port '%s', now press the HotSync button ...\n", port);
+    if (pi_listen(*listenSd, 1) < 0 || (sd = pi_accept(*listenSd, 0, 0)) < 0) {
+        fprintf(stderr, "Could not accept the device on port '%s'\n", port);
+        return -1;
+    }
+    if (dlp_OpenConduit(sd) < 0) {
+        fprintf(stderr, "Could not open the conduit, as the sync was cancelled on the device\n");
+        pi_close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+int main(int argc, char *argv[]) {
+    const char *port = getenv("PILOTPORT"), *home = NULL;
+    syncContext *context;
+    int listenSd = -1, sd, result, opt;
+
+    while ((opt = getopt(argc, argv, "p:m:o:dqh")) != -1) {
+        switch (opt) {
+            case 'p': port = optarg; break;
+            case 'm': home = optarg; break;
+            case 'o': {
+                char *value = strchr(optarg, '=');
+                if (value)  *value++ = '\0';
+                if (jpStubOverridePref(optarg, value ? value : "")) {
+                    fprintf(stderr, "Too many prefs given\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case 'd': glob_log_stdout_mask |= JP_LOG_DEBUG; break;
+            case 'q': glob_log_stdout_mask = JP_LOG_FATAL; break;
+            default: fputs(USAGE, stderr); return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        fputs(USAGE, stderr);
+        return EXIT_FAILURE;
+    }
+    if (!(context = syncContextNew(home))) {
+        fprintf(stderr, "Out of memory, or media dir '%s' too long\n", home ? home : "");
+        return EXIT_FAILURE;
+    }
+    jp_init();
+    if ((sd = connectDevice(port ? port : "usb:", &listenSd)) < 0) {
+        result = EXIT_FAILURE;
+    } else {
+        result = syncDevice(context, sd);
+        dlp_EndOfSync(sd, result == EXIT_SUCCESS ? dlpEndCodeNormal : dlpEndCodeOther);
+        pi_close(sd);
+    }
+    if (listenSd >= 0)  pi_close(listenSd);
+    syncContextFree(context);
+    return result;
+}
@@ -0,0 +1,410 @@
+/*******************************************************************************
+ * vfssim.c
+ *
+ * Simulated Palm VFS device for running the Media plugin without a real Palm.
+ * Replaces the dlp_VFS* functions and pi_buffer_t of libpisock, which media.c uses,
+ * by a local directory tree with a configurable latency and bandwidth model and
+ * the known quirks of real devices.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <pi-dlp.h>
+#include <pi-util.h>
+
+#include "vfssim.h"
+
+#define MAX_REFS 64
+#define BROKEN_ITR 1888
+
+typedef struct simRef {
+    int used, volRef;
+    char path[PATH_MAX];
+    FILE *fileP;
+    char **names; // dir items, loaded on first enumeration
+    int nameCount;
+} simRef;
+
+static vfsSimConfig config;
+static vfsSimStats *stats, localStats; // shared with parent, if possible, as JPilot syncs in a forked child
+static simRef refs[MAX_REFS];
+static int palmOSErr;
+static int dead; // connection was killed by a simulated crash
+
+/* Account one DLP round trip, which transfers bytes over the link. */
+static void roundTrip(const size_t bytes) {
+    if (config.dropAfterBytes && stats->bytesIn + stats->bytesOut >= config.dropAfterBytes)
+        dead = 1; // as if the Palm was taken from the cradle
+    double secs = config.latencyUs / 1e6 + (config.bandwidth > 0 ? (double)bytes / config.bandwidth : 0);
+    stats->calls++;
+    stats->modeledSecs += secs;
+    if (config.realTime && secs > 0)
+        usleep((useconds_t)(secs * 1e6));
+}
+
+static PI_ERR palmOSError(const int err) {
+    palmOSErr = err;
+    return PI_ERR_DLP_PALMOS;
+}
+
+static char *localPath(char *buf, const int volRef, const char *path) {
+    snprintf(buf, PATH_MAX, "%s/%d%s", config.root, volRef, path);
+    return buf;
+}
+
+static simRef *getRef(const FileRef fileRef) {
+    return fileRef > 0 && fileRef <= MAX_REFS && refs[fileRef - 1].used ? refs + fileRef - 1 : NULL;
+}
+
+void vfsSimInit(const vfsSimConfig *newConfig) {
+    config = *newConfig;
+    dead = 0;
+    if (!stats && (stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        stats = &localStats;
+    vfsSimStatsReset();
+}
+
+const vfsSimStats *vfsSimStatsGet(void) {
+    return stats;
+}
+
+void vfsSimStatsReset(void) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+/***********************************************************************/
+
+pi_buffer_t *pi_buffer_new(size_t capacity) {
+    pi_buffer_t *buf;
+    if (!(buf = malloc(sizeof(*buf))))  return NULL;
+    if (!(buf->data = malloc(capacity ? capacity : 1))) {
+        free(buf);
+        return NULL;
+    }
+    buf->allocated = capacity;
+    buf->used = 0;
+    return buf;
+}
+
+pi_buffer_t *pi_buffer_expect(pi_buffer_t *buf, size_t expect) {
+    if (buf->allocated - buf->used < expect) {
+        unsigned char *data = realloc(buf->data, buf->used + expect);
+        if (!data)  return NULL;
+        buf->data = data;
+        buf->allocated = buf->used + expect;
+    }
+    return buf;
+}
+
+pi_buffer_t *pi_buffer_append(pi_buffer_t *buf, const void *data, size_t len) {
+    if (!pi_buffer_expect(buf, len))  return NULL;
+    memcpy(buf->data + buf->used, data, len);
+    buf->used += len;
+    return buf;
+}
+
+pi_buffer_t *pi_buffer_clear(pi_buffer_t *buf) {
+    buf->used = 0;
+    return buf;
+}
+
+void pi_buffer_free(pi_buffer_t *buf) {
+    if (buf) {
+        free(buf->data);
+        free(buf);
+    }
+}
+
+int pi_palmos_error(int sd) {
+    return palmOSErr;
+}
+
+/***********************************************************************/
+
+int dlp_VFSVolumeEnumerate(int sd, int *numVols, int *volRefs) {
+    DIR *dirP;
+    int max = *numVols;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(8);
+    *numVols = 0;
+    if (!(dirP = opendir(config.root)))  return palmOSError(10761);
+    for (struct dirent *entry; (entry = readdir(dirP)) && *numVols < max;) {
+        int volRef = atoi(entry->d_name);
+        if (volRef > 1) // Volume 1 is hidden.
+            volRefs[(*numVols)++] = volRef;
+    }
+    closedir(dirP);
+    return *numVols ? 2 * *numVols : palmOSError(10761);
+}
+
+int dlp_VFSVolumeInfo(int sd, int volRefNum, struct VFSInfo *volInfo) {
+    char path[PATH_MAX];
+    struct stat fileStat;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(sizeof(*volInfo));
+    if (stat(localPath(path, volRefNum, ""), &fileStat) || !S_ISDIR(fileStat.st_mode))
+        return palmOSError(10761);
+    memset(volInfo, 0, sizeof(*volInfo));
+    volInfo->attributes = volRefNum == 1 ? vfsVolAttrHidden : vfsVolAttrSlotBased;
+    volInfo->mediaType = volRefNum == 1 ? pi_mktag('T', 'F', 'F', 'S') : pi_mktag('s', 'd', 'i', 'g');
+    volInfo->slotRefNum = volRefNum;
+    return sizeof(*volInfo);
+}
+
+int dlp_VFSFileOpen(int sd, int volRefNum, const char *path, int openMode, FileRef *fileRef) {
+    char lcPath[PATH_MAX];
+    struct stat fileStat;
+    simRef *ref = NULL;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(strlen(path));
+    for (int i = 0; i < MAX_REFS; i++) {
+        if (!refs[i].used) {
+            ref = refs + i;
+            break;
+        }
+    }
+    if (!ref)  return palmOSError(10764); // too many open files
+    localPath(lcPath, volRefNum, path);
+    if (stat(lcPath, &fileStat)) {
+        if (!(openMode & vfsModeCreate))  return palmOSError(10760);
+        if (!(ref->fileP = fopen(lcPath, "w+")))  return palmOSError(10760);
+    } else if (!S_ISDIR(fileStat.st_mode)) {
+        if (!(ref->fileP = fopen(lcPath, (openMode & vfsModeWrite) == vfsModeWrite ? "r+" : "r")))
+            return palmOSError(10760);
+    } else {
+        ref->fileP = NULL;
+    }
+    strcpy(ref->path, lcPath);
+    ref->used = 1;
+    ref->volRef = volRefNum;
+    ref->names = NULL;
+    ref->nameCount = 0;
+    *fileRef = ref - refs + 1;
+    return 0;
+}
+
+int dlp_VFSFileClose(int sd, FileRef fileRef) {
+    simRef *ref;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(4);
+    if (!(ref = getRef(fileRef)))  return palmOSError(10762);
+    if (ref->fileP)  fclose(ref->fileP);
+    for (int i = 0; i < ref->nameCount; i++)
+        free(ref->names[i]);
+    free(ref->names);
+    ref->used = 0;
+    return 0;
+}
+
+int dlp_VFSFileRead(int sd, FileRef fileRef, pi_buffer_t *data, size_t numBytes) {
+    simRef *ref;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    pi_buffer_clear(data);
+    if (!(ref = getRef(fileRef)) || !ref->fileP)  return palmOSError(10762);
+    if (!pi_buffer_expect(data, numBytes))  return PI_ERR_GENERIC_MEMORY;
+    size_t bytes = fread(data->data, 1, numBytes, ref->fileP);
+    data->used = bytes;
+    roundTrip(bytes);
+    stats->bytesIn += bytes;
+    return (int)bytes;
+}
+
+int dlp_VFSFileWrite(int sd, FileRef fileRef, const void *data, size_t len) {
+    simRef *ref;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(len);
+    if (!(ref = getRef(fileRef)) || !ref->fileP)  return palmOSError(10762);
+    size_t bytes = fwrite(data, 1, len, ref->fileP);
+    stats->bytesOut += bytes;
+    return bytes < len ? palmOSError(10767) : (int)bytes;
+}
+
+int dlp_VFSFileSize(int sd, FileRef fileRef, int *size) {
+    simRef *ref;
+    struct stat fileStat;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(4);
+    if (!(ref = getRef(fileRef)) || !ref->fileP)  return palmOSError(10762);
+    fflush(ref->fileP);
+    if (fstat(fileno(ref->fileP), &fileStat))  return palmOSError(10762);
+    *size = (int)fileStat.st_size;
+    return 0;
+}
+
+int dlp_VFSFileGetDate(int sd, FileRef fileRef, int which, time_t *date) {
+    simRef *ref;
+    struct stat fileStat;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(4);
+    if (!(ref = getRef(fileRef)) || stat(ref->path, &fileStat))  return palmOSError(10762);
+    *date = fileStat.st_mtime; // Linux has no 'created date', so both are the same.
+    return 0;
+}
+
+int dlp_VFSFileSetDate(int sd, FileRef fileRef, int which, time_t date) {
+    simRef *ref;
+    struct utimbuf utim;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(8);
+    if (!(ref = getRef(fileRef)))  return palmOSError(10762);
+    if (ref->fileP)  fflush(ref->fileP);
+    utim.actime = utim.modtime = date;
+    return utime(ref->path, &utim) ? palmOSError(10762) : 0;
+}
+
+int dlp_VFSFileSeek(int sd, FileRef fileRef, int origin, int offset) {
+    simRef *ref;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(8);
+    if (!(ref = getRef(fileRef)) || !ref->fileP)  return palmOSError(10762);
+    return fseek(ref->fileP, offset, origin == vfsOriginEnd ? SEEK_END : origin == vfsOriginCurrent ? SEEK_CUR : SEEK_SET)
+            ? palmOSError(10762) : 0;
+}
+
+int dlp_VFSFileDelete(int sd, int volRefNum, const char *name) {
+    char lcPath[PATH_MAX];
+    struct stat fileStat;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(strlen(name));
+    if (stat(localPath(lcPath, volRefNum, name), &fileStat))  return palmOSError(10760);
+    if (S_ISDIR(fileStat.st_mode))
+        return rmdir(lcPath) ? palmOSError(10765) : 0;
+    return unlink(lcPath) ? palmOSError(10760) : 0;
+}
+
+int dlp_VFSFileRename(int sd, int volRefNum, const char *path, const char *newname) {
+    char lcPath[PATH_MAX], newPath[PATH_MAX + NAME_MAX + 2];
+    char *slash;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(strlen(path) + strlen(newname));
+    localPath(lcPath, volRefNum, path);
+    strcpy(newPath, lcPath);
+    if (!(slash = strrchr(newPath, '/')) || strchr(newname, '/'))  return palmOSError(10763); // bad name
+    strcpy(slash + 1, newname);
+    if (!access(newPath, F_OK))  return palmOSError(10758); // already exists
+    return rename(lcPath, newPath) ? palmOSError(10760) : 0;
+}
+
+int dlp_VFSDirCreate(int sd, int volRefNum, const char *path) {
+    char lcPath[PATH_MAX];
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(strlen(path));
+    if (mkdir(localPath(lcPath, volRefNum, path), 0777))
+        return palmOSError(errno == EEXIST ? 10758 : 10760); // 10758: already exists
+    return 0;
+}
+
+int dlp_VFSFileGetAttributes(int sd, FileRef fileRef, unsigned long *attributes) {
+    simRef *ref;
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(4);
+    if (!(ref = getRef(fileRef)))  return palmOSError(10762);
+    *attributes = ref->fileP ? 0 : vfsFileAttrDirectory;
+    return 0;
+}
+
+static int cmpNames(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int dlp_VFSDirEntryEnumerate(int sd, FileRef dirRefNum, unsigned long *dirIterator, int *maxDirItems, struct VFSDirInfo *dirItems) {
+    simRef *ref;
+    struct stat fileStat;
+    char path[PATH_MAX + NAME_MAX + 2];
+
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    if (!(ref = getRef(dirRefNum)) || ref->fileP)  return palmOSError(10762);
+    if (!ref->names) {
+        DIR *dirP;
+        int allocated = 0;
+        if (!(dirP = opendir(ref->path)))  return palmOSError(10760);
+        for (struct dirent *entry; (entry = readdir(dirP));) {
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))  continue;
+            if (ref->nameCount >= allocated)
+                ref->names = realloc(ref->names, (allocated = allocated ? 2 * allocated : 64) * sizeof(char *));
+            ref->names[ref->nameCount++] = strdup(entry->d_name);
+        }
+        closedir(dirP);
+        if (!ref->names)  ref->names = malloc(sizeof(char *));
+        qsort(ref->names, ref->nameCount, sizeof(char *), cmpNames);
+    }
+    if (!ref->nameCount && config.crashOnEmptyDir) {
+        roundTrip(0);
+        dead = 1;
+        return PI_ERR_SOCK_DISCONNECTED;
+    }
+    int start = *dirIterator == (unsigned long)vfsIteratorStart || *dirIterator == BROKEN_ITR ? 0 : (int)*dirIterator;
+    int count = MIN(*maxDirItems, ref->nameCount - start);
+    if (start > ref->nameCount)  return palmOSError(10762);
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        const char *name = ref->names[start + i];
+        memset(dirItems + i, 0, sizeof(*dirItems));
+        strncpy(dirItems[i].name, name, sizeof(dirItems[i].name) - 1);
+        snprintf(path, sizeof(path), "%s/%s", ref->path, name);
+        dirItems[i].attr = !stat(path, &fileStat) && S_ISDIR(fileStat.st_mode) ? vfsFileAttrDirectory : 0;
+        bytes += 4 + strlen(name) + 1;
+    }
+    roundTrip(bytes);
+    *maxDirItems = count;
+    if (start + count >= ref->nameCount)
+        *dirIterator = (unsigned long)vfsIteratorStop;
+    else
+        *dirIterator = config.brokenIterator ? BROKEN_ITR : (unsigned long)(start + count);
+    return 0;
+}
+
+int dlp_AddSyncLogEntry(int sd, char *entry) {
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(strlen(entry));
+    return 0;
+}
+
+int dlp_ReadUserInfo(int sd, struct PilotUser *user) {
+    if (dead)  return PI_ERR_SOCK_DISCONNECTED;
+    roundTrip(sizeof(*user));
+    memset(user, 0, sizeof(*user));
+    user->userID = 4711;
+    strcpy(user->username, "Simulated Palm");
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*******************************************************************************
+ * vfssim.h
+ *
+ * Simulated Palm VFS device for running the Media plugin without a real Palm.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ ******************************************************************************/
+
+#ifndef __VFSSIM_H__
+#define __VFSSIM_H__
+
+/*
+ * The device is backed by a local directory root, which holds one sub directory per volume number.
+ * Volume 1 is simulated as the hidden internal 'TFFS' volume, all others as SD cards.
+ */
+typedef struct vfsSimConfig {
+    const char *root;
+    long latencyUs;     // Modeled time per DLP call.
+    long bandwidth;     // Modeled bytes per second on the link, 0 = unlimited.
+    int realTime;       // Really sleep the modeled time, otherwise only account it.
+    int brokenIterator; // Return iterator value 1888 after the first batch, which restarts enumeration, as seen on SD cards.
+    int crashOnEmptyDir;// Enumerating an empty dir kills the connection, see: <https://github.com/desrod/pilot-link/issues/11>.
+    long long dropAfterBytes; // Drop the connection, after this number of bytes was transferred in a sync, 0 = never.
+} vfsSimConfig;
+
+typedef struct vfsSimStats {
+    long calls;         // DLP round trips
+    long long bytesIn;  // Bytes read from the device
+    long long bytesOut; // Bytes written to the device
+    double modeledSecs; // Modeled link time of all calls
+} vfsSimStats;
+
+void vfsSimInit(const vfsSimConfig *config);
+const vfsSimStats *vfsSimStatsGet(void);
+void vfsSimStatsReset(void);
+
+#endif